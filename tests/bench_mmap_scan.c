@@ -0,0 +1,223 @@
+/*
+ * bench_mmap_scan.c  --  measure how fast a consumer can scan mmap'ed frames
+ *
+ * feeds frames into a loopback device and reads them back through mmap'ed
+ * CAPTURE buffers, reporting the throughput of
+ *  - a sequential scan over the entire frame (bandwidth bound)
+ *  - a scan touching a single word per 4KiB page (TLB bound)
+ *
+ * compare a device created with 'hugepages=1' against one without;
+ * buffers are mapped at 2MiB aligned addresses (unless '-u' is given), so the
+ * kernel can use huge page-table entries.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COUNT 2
+#define HUGE_ALIGN (2u << 20)
+#define sysfail(msg)                                               \
+	{                                                          \
+		printf("%s failed: %s\n", (msg), strerror(errno)); \
+		return -1;                                         \
+	}
+
+struct buffer {
+	struct v4l2_buffer buf;
+	void *start;
+};
+
+static int unaligned = 0;
+
+void usage(const char *progname)
+{
+	printf("usage: %s [-u] <videodevice> [<width> <height> [<frames>]]\n",
+	       progname);
+	printf("\t-u: do not align mappings to 2MiB\n");
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* maps a buffer at a 2MiB aligned address (if requested) */
+static void *map_buffer(int fd, int prot, struct v4l2_buffer *buf)
+{
+	size_t length = buf->length;
+	char *area, *addr;
+
+	if (unaligned)
+		return mmap(NULL, length, prot, MAP_SHARED, fd, buf->m.offset);
+
+	area = mmap(NULL, length + HUGE_ALIGN, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		return area;
+	addr = (char *)(((uintptr_t)area + HUGE_ALIGN - 1) &
+			~(uintptr_t)(HUGE_ALIGN - 1));
+	if (addr > area)
+		munmap(area, addr - area);
+	munmap(addr + length, (area + length + HUGE_ALIGN) - (addr + length));
+	return mmap(addr, length, prot, MAP_SHARED | MAP_FIXED, fd,
+		    buf->m.offset);
+}
+
+static int setup(int fd, enum v4l2_buf_type type, struct buffer *bufs,
+		 int prot)
+{
+	struct v4l2_requestbuffers breq = { 0 };
+	int i;
+
+	breq.count = COUNT;
+	breq.type = type;
+	breq.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(fd, VIDIOC_REQBUFS, &breq) < 0)
+		sysfail("REQBUFS");
+	if (breq.count < COUNT) {
+		printf("got only %d buffers\n", breq.count);
+		return -1;
+	}
+
+	for (i = 0; i < COUNT; i++) {
+		struct v4l2_buffer *buf = &bufs[i].buf;
+		memset(buf, 0, sizeof(*buf));
+		buf->index = i;
+		buf->type = type;
+		buf->memory = V4L2_MEMORY_MMAP;
+		if (ioctl(fd, VIDIOC_QUERYBUF, buf) < 0)
+			sysfail("QUERYBUF");
+		bufs[i].start = map_buffer(fd, prot, buf);
+		if (bufs[i].start == MAP_FAILED)
+			sysfail("mmap");
+		if (prot & PROT_WRITE)
+			memset(bufs[i].start, i + 1, buf->length);
+		if (ioctl(fd, VIDIOC_QBUF, buf) < 0)
+			sysfail("QBUF");
+	}
+	if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
+		sysfail("STREAMON");
+	return 0;
+}
+
+static uint64_t scan_all(const uint64_t *data, size_t size)
+{
+	uint64_t sum = 0;
+	size_t i;
+	for (i = 0; i < size / sizeof(*data); i++)
+		sum += data[i];
+	return sum;
+}
+
+static uint64_t scan_pages(const uint64_t *data, size_t size)
+{
+	uint64_t sum = 0;
+	size_t i;
+	for (i = 0; i < size / sizeof(*data); i += 4096 / sizeof(*data))
+		sum += data[i];
+	return sum;
+}
+
+int main(int argc, char **argv)
+{
+	struct v4l2_format fmt = { 0 };
+	struct buffer outbufs[COUNT], capbufs[COUNT];
+	unsigned int width = 3840, height = 2160;
+	int frames = 500;
+	int outfd, capfd;
+	double t_all = 0., t_pages = 0.;
+	uint64_t sum = 0;
+	size_t size;
+	int i;
+
+	if (argc > 1 && !strcmp(argv[1], "-u")) {
+		unaligned = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 2)
+		usage(argv[0]);
+	if (argc > 3) {
+		width = atoi(argv[2]);
+		height = atoi(argv[3]);
+	}
+	if (argc > 4)
+		frames = atoi(argv[4]);
+
+	outfd = open(argv[1], O_RDWR);
+	capfd = open(argv[1], O_RDWR);
+	if (outfd < 0 || capfd < 0)
+		sysfail("open");
+
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = width;
+	fmt.fmt.pix.height = height;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	if (ioctl(outfd, VIDIOC_S_FMT, &fmt) < 0)
+		sysfail("S_FMT");
+	size = fmt.fmt.pix.sizeimage;
+
+	if (setup(outfd, V4L2_BUF_TYPE_VIDEO_OUTPUT, outbufs, PROT_WRITE) < 0)
+		return 1;
+	if (setup(capfd, V4L2_BUF_TYPE_VIDEO_CAPTURE, capbufs, PROT_READ) < 0)
+		return 1;
+
+	printf("%ux%u YUYV: %zu bytes/frame in %u byte buffers\n", width,
+	       height, size, capbufs[0].buf.length);
+
+	for (i = 0; i < frames; i++) {
+		struct v4l2_buffer buf = { 0 };
+		const uint64_t *data;
+		double t0, t1, t2;
+
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (ioctl(outfd, VIDIOC_DQBUF, &buf) < 0)
+			sysfail("DQBUF(output)");
+		if (ioctl(outfd, VIDIOC_QBUF, &buf) < 0)
+			sysfail("QBUF(output)");
+
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (ioctl(capfd, VIDIOC_DQBUF, &buf) < 0)
+			sysfail("DQBUF(capture)");
+		data = capbufs[buf.index].start;
+
+		t0 = now();
+		sum += scan_all(data, size);
+		t1 = now();
+		sum += scan_pages(data, size);
+		t2 = now();
+		t_all += t1 - t0;
+		t_pages += t2 - t1;
+
+		if (ioctl(capfd, VIDIOC_QBUF, &buf) < 0)
+			sysfail("QBUF(capture)");
+	}
+
+	printf("sequential scan: %8.1f MiB/s\n",
+	       (double)size * frames / t_all / (1 << 20));
+	printf("per-page scan  : %8.1f ns/page\n",
+	       t_pages * 1e9 / ((double)frames * (size / 4096)));
+	printf("(checksum %llu)\n", (unsigned long long)sum);
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * bench_wakeups.c  --  count consumer wakeups per frame
+ *
+ * writes frames into a loopback device while a growing number of processes
+ * have it open: a single reader, which poll()s for POLLIN and read()s every
+ * frame, and watchers, which merely poll() for events (like a control panel
+ * would) and cannot read frames (the CAPTURE stream is taken).
+ * reports the voluntary context switches per frame for both groups; ideally,
+ * the reader wakes up once per frame and the watchers not at all.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define sysfail(msg)                                               \
+	{                                                          \
+		printf("%s failed: %s\n", (msg), strerror(errno)); \
+		return -1;                                         \
+	}
+
+struct report {
+	int reader;
+	long wakeups;
+};
+
+static const char *device;
+static size_t size;
+
+void usage(const char *progname)
+{
+	printf("usage: %s <videodevice> [<max_watchers> [<frames> [<fps>]]]\n",
+	       progname);
+	exit(1);
+}
+
+/* runs in a child: poll() the device until the parent closes `ctl`, then
+ * report the number of voluntary context switches on `result` */
+static int consumer(int reader, int ctl, int result)
+{
+	struct pollfd pfd[2];
+	struct rusage usage;
+	struct report report = { reader, 0 };
+	char *data = malloc(size);
+	int fd;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0 || !data)
+		sysfail("open");
+	/* the first read() makes this a capture opener */
+	if (reader && read(fd, data, size) < 0)
+		sysfail("read");
+
+	pfd[0].fd = fd;
+	pfd[0].events = reader ? POLLIN : POLLPRI;
+	pfd[1].fd = ctl;
+	pfd[1].events = POLLIN;
+
+	getrusage(RUSAGE_SELF, &usage);
+	report.wakeups = -usage.ru_nvcsw;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0)
+			sysfail("poll");
+		if (pfd[1].revents)
+			break;
+		if ((pfd[0].revents & POLLIN) && read(fd, data, size) < 0)
+			sysfail("read");
+	}
+	getrusage(RUSAGE_SELF, &usage);
+	report.wakeups += usage.ru_nvcsw;
+
+	if (write(result, &report, sizeof(report)) != sizeof(report))
+		sysfail("write");
+	close(fd);
+	free(data);
+	return 0;
+}
+
+static int run(int outfd, int watchers, int frames, int fps)
+{
+	struct timespec period = { 0, 1000000000L / fps };
+	char *data = calloc(1, size);
+	struct report report;
+	long reader_wakeups = 0, watcher_wakeups = 0;
+	int ctl[2], result[2];
+	int i;
+
+	if (!data || pipe(ctl) < 0 || pipe(result) < 0)
+		sysfail("pipe");
+	for (i = 0; i <= watchers; i++) {
+		pid_t pid = fork();
+		if (pid < 0)
+			sysfail("fork");
+		if (!pid) {
+			close(ctl[1]);
+			close(result[0]);
+			exit(consumer(i == 0, ctl[0], result[1]) < 0);
+		}
+	}
+	close(ctl[0]);
+	/* so a failing consumer does not leave us waiting for its report */
+	close(result[1]);
+
+	/* let the consumers settle */
+	nanosleep(&period, NULL);
+	for (i = 0; i < frames; i++) {
+		if (write(outfd, data, size) < 0)
+			sysfail("write");
+		nanosleep(&period, NULL);
+	}
+	close(ctl[1]);
+
+	for (i = 0; i <= watchers; i++) {
+		if (read(result[0], &report, sizeof(report)) != sizeof(report))
+			sysfail("read(report)");
+		if (report.reader)
+			reader_wakeups += report.wakeups;
+		else
+			watcher_wakeups += report.wakeups;
+	}
+	while (wait(NULL) > 0)
+		;
+	close(result[0]);
+	free(data);
+
+	printf("%3d watchers: %6.2f reader wakeups/frame, "
+	       "%6.2f wakeups/frame per watcher\n",
+	       watchers, (double)reader_wakeups / frames,
+	       watchers ? (double)watcher_wakeups / frames / watchers : 0.);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct v4l2_format fmt = { 0 };
+	int max_watchers = 16, frames = 200, fps = 100;
+	char *data;
+	int outfd, n;
+
+	if (argc < 2)
+		usage(argv[0]);
+	device = argv[1];
+	if (argc > 2)
+		max_watchers = atoi(argv[2]);
+	if (argc > 3)
+		frames = atoi(argv[3]);
+	if (argc > 4)
+		fps = atoi(argv[4]);
+	if (max_watchers < 0 || frames < 1 || fps < 2)
+		usage(argv[0]);
+
+	outfd = open(device, O_RDWR);
+	if (outfd < 0)
+		sysfail("open");
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = 320;
+	fmt.fmt.pix.height = 240;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	if (ioctl(outfd, VIDIOC_S_FMT, &fmt) < 0)
+		sysfail("S_FMT");
+	size = fmt.fmt.pix.sizeimage;
+
+	/* start the OUTPUT stream, so consumers can attach */
+	data = calloc(1, size);
+	if (!data)
+		sysfail("calloc");
+	if (write(outfd, data, size) < 0)
+		sysfail("write");
+	free(data);
+
+	for (n = 0; n <= max_watchers; n = n ? 2 * n : 1)
+		if (run(outfd, n, frames, fps) < 0)
+			return 1;
+
+	close(outfd);
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * test_sustain_jitter.c  --  check the timing of frames duplicated by
+ *                            'sustain_framerate'
+ *
+ * writes a single frame into a loopback device (with 'sustain_framerate'
+ * enabled) and then reads the duplicates the driver produces, measuring how
+ * far each of them arrives from its nominal frame boundary.
+ * the test fails if any duplicate is off by more than the jitter target
+ * (default: 1000us; a jiffies based timer at HZ=250 is off by up to 4000us).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+/* from v4l2loopback.c */
+#define CID_SUSTAIN_FRAMERATE ((V4L2_CID_USER_BASE | 0xf000) + 1)
+
+/* skip the written frame and the first duplicate, which stands in for a late
+ * frame and is not on the grid (see sustain_timer_expired()) */
+#define SKIP 2
+
+#define sysfail(msg)                                               \
+	{                                                          \
+		printf("%s failed: %s\n", (msg), strerror(errno)); \
+		return -1;                                         \
+	}
+
+void usage(const char *progname)
+{
+	printf("usage: %s <videodevice> [<fps> [<frames> [<jitter_us>]]]\n",
+	       progname);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+	struct v4l2_format fmt = { 0 };
+	struct v4l2_streamparm parm = { 0 };
+	struct v4l2_control ctrl = { 0 };
+	unsigned int fps = 60;
+	int frames = 300;
+	double target = 1000e-6;
+	double period, t0 = 0., t, dev, max_dev = 0., sum_dev = 0.;
+	int outfd, capfd;
+	char *data;
+	size_t size;
+	int i;
+
+	if (argc < 2)
+		usage(argv[0]);
+	if (argc > 2)
+		fps = atoi(argv[2]);
+	if (argc > 3)
+		frames = atoi(argv[3]);
+	if (argc > 4)
+		target = atof(argv[4]) * 1e-6;
+	if (!fps || frames <= SKIP)
+		usage(argv[0]);
+	period = 1. / fps;
+
+	outfd = open(argv[1], O_RDWR);
+	capfd = open(argv[1], O_RDWR);
+	if (outfd < 0 || capfd < 0)
+		sysfail("open");
+
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = 320;
+	fmt.fmt.pix.height = 240;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	if (ioctl(outfd, VIDIOC_S_FMT, &fmt) < 0)
+		sysfail("S_FMT");
+	size = fmt.fmt.pix.sizeimage;
+
+	parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	parm.parm.output.timeperframe.numerator = 1;
+	parm.parm.output.timeperframe.denominator = fps;
+	if (ioctl(outfd, VIDIOC_S_PARM, &parm) < 0)
+		sysfail("S_PARM");
+
+	ctrl.id = CID_SUSTAIN_FRAMERATE;
+	ctrl.value = 1;
+	if (ioctl(outfd, VIDIOC_S_CTRL, &ctrl) < 0)
+		sysfail("S_CTRL(sustain_framerate)");
+
+	data = calloc(1, size);
+	if (!data)
+		sysfail("calloc");
+
+	/* a single frame; everything after it is a duplicate */
+	if (write(outfd, data, size) < 0)
+		sysfail("write");
+
+	for (i = 0; i < frames; i++) {
+		if (read(capfd, data, size) < 0)
+			sysfail("read");
+		t = now();
+		if (i < SKIP)
+			continue;
+		if (i == SKIP) {
+			t0 = t;
+			continue;
+		}
+		/* distance from the boundary, relative to the first duplicate on
+		 * the grid, so drift accumulates as well */
+		dev = t - (t0 + (i - SKIP) * period);
+		if (dev < 0)
+			dev = -dev;
+		sum_dev += dev;
+		if (dev > max_dev)
+			max_dev = dev;
+	}
+
+	printf("%u fps, %d duplicates: mean jitter %.1fus, max jitter %.1fus "
+	       "(target %.1fus)\n",
+	       fps, frames - SKIP - 1, sum_dev * 1e6 / (frames - SKIP - 1),
+	       max_dev * 1e6, target * 1e6);
+	free(data);
+	close(capfd);
+	close(outfd);
+
+	if (max_dev > target) {
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -51,6 +51,7 @@ struct v4l2l_format {
 };
 #define FORMAT_FLAGS_PLANAR 0x01
 #define FORMAT_FLAGS_COMPRESSED 0x02
+#define FORMAT_FLAGS_MPLANE 0x04
 #include "../v4l2loopback_formats.h"
 
 /********************/
@@ -17,6 +17,7 @@
 #include <linux/vmalloc.h>
 #include <linux/mm.h>
 #include <linux/time.h>
+#include <linux/hrtimer.h>
 #include <linux/module.h>
 #include <linux/videodev2.h>
 #include <linux/sched.h>
@@ -24,6 +25,10 @@
 #include <linux/fs.h>
 #include <linux/capability.h>
 #include <linux/eventpoll.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/io.h>
+#include <linux/bitmap.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-common.h>
 #include <media/v4l2-device.h>
@@ -45,10 +50,76 @@
 #define HAVE_TIMER_SETUP
 #endif
 
+/* hrtimer callbacks can run in softirq context since 4.16; older kernels fall
+ * back to timer lists, as `dev->lock` is not irq-safe */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define HAVE_HRTIMER_SOFT
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+#define hrtimer_setup(timer, fn, clock, mode)        \
+	do {                                         \
+		hrtimer_init((timer), (clock), (mode)); \
+		(timer)->function = (fn);            \
+	} while (0)
+#endif
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 7, 0)
 #define VFL_TYPE_VIDEO VFL_TYPE_GRABBER
 #endif
 
+/* dma-buf exporters no longer need kmap callbacks, and dma_map_sgtable() is
+ * available since 5.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#define HAVE_DMABUF
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#define v4l2l_vmap_t struct iosys_map
+#define v4l2l_vmap_set_vaddr iosys_map_set_vaddr
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#define v4l2l_vmap_t struct dma_buf_map
+#define v4l2l_vmap_set_vaddr dma_buf_map_set_vaddr
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define v4l2l_dma_buf_vmap dma_buf_vmap_unlocked
+#define v4l2l_dma_buf_vunmap dma_buf_vunmap_unlocked
+#else
+#define v4l2l_dma_buf_vmap dma_buf_vmap
+#define v4l2l_dma_buf_vunmap dma_buf_vunmap
+#endif
+#endif /* >=linux-5.8.0 */
+
+/* the multi-planar API; formats are enumerated through the single-planar
+ * callbacks since 5.3, and v4l2_format_info() describes their planes */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+#define HAVE_MPLANE
+#endif
+
+/* the frame metadata and damage are passed through array controls, which
+ * need to be volatile and yet writable (V4L2_CTRL_FLAG_EXECUTE_ON_WRITE) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+#define HAVE_FRAME_METADATA
+#endif
+
+/* buffers backed by huge pages are mapped with PMDs from ->huge_fault();
+ * these are PFN mappings of RAM, which the mm core handles properly (GUP,
+ * fork, zapping) only since 6.12, and only on architectures that opt in */
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) &&          \
+	defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#define HAVE_HUGEPAGES
+#include <linux/huge_mm.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+#define v4l2l_pfn_t(pfn) (pfn)
+#else
+#include <linux/pfn_t.h>
+#define v4l2l_pfn_t(pfn) pfn_to_pfn_t(pfn)
+#endif
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+#define vm_flags_set(vma, flags) ((vma)->vm_flags |= (flags))
+#define vm_flags_clear(vma, flags) ((vma)->vm_flags &= ~(flags))
+#endif
+
 #define V4L2LOOPBACK_VERSION_CODE                                              \
 	KERNEL_VERSION(V4L2LOOPBACK_VERSION_MAJOR, V4L2LOOPBACK_VERSION_MINOR, \
 		       V4L2LOOPBACK_VERSION_BUGFIX)
@@ -66,6 +137,13 @@ MODULE_VERSION("" __stringify(V4L2LOOPBACK_VERSION_MAJOR) "." __stringify(
 	V4L2LOOPBACK_VERSION_MINOR) "." __stringify(V4L2LOOPBACK_VERSION_BUGFIX));
 #endif
 MODULE_LICENSE("GPL");
+#ifdef HAVE_DMABUF
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+#endif /* HAVE_DMABUF */
 
 /*
  * helpers
@@ -145,6 +223,11 @@ typedef unsigned __poll_t;
 #define V4L2LOOPBACK_DEFAULT_EXCLUSIVECAPS 0
 #endif
 
+/* whether the default is to back buffers with huge pages or not */
+#ifndef V4L2LOOPBACK_DEFAULT_HUGEPAGES
+#define V4L2LOOPBACK_DEFAULT_HUGEPAGES 0
+#endif
+
 /* when a producer is considered to have gone stale */
 #ifndef MAX_TIMEOUT
 #define MAX_TIMEOUT (100 * 1000) /* in msecs */
@@ -156,6 +239,9 @@ typedef unsigned __poll_t;
 #define MAX_BUFFERS 32
 #endif
 
+/* max memory planes per buffer (for the multi-planar API) */
+#define MAX_PLANES 3
+
 /* module parameters */
 static int debug = 0;
 module_param(debug, int, S_IRUGO | S_IWUSR);
@@ -207,6 +293,15 @@ MODULE_PARM_DESC(
 	"whether to announce OUTPUT/CAPTURE capabilities exclusively or not  [DEFAULT: " __stringify(
 		V4L2LOOPBACK_DEFAULT_EXCLUSIVECAPS) "]");
 
+static bool hugepages[MAX_DEVICES] = {
+	[0 ...(MAX_DEVICES - 1)] = V4L2LOOPBACK_DEFAULT_HUGEPAGES
+};
+module_param_array(hugepages, bool, NULL, 0444);
+MODULE_PARM_DESC(
+	hugepages,
+	"whether to back buffers with (2MiB) huge pages, so they can be mapped with fewer TLB entries (requires transparent hugepages) [DEFAULT: " __stringify(
+		V4L2LOOPBACK_DEFAULT_HUGEPAGES) "]");
+
 /* format specifications */
 #define V4L2LOOPBACK_SIZE_MIN_WIDTH 2
 #define V4L2LOOPBACK_SIZE_MIN_HEIGHT 1
@@ -241,11 +336,34 @@ static DEFINE_MUTEX(v4l2loopback_ctl_mutex);
 #define CID_SUSTAIN_FRAMERATE (V4L2LOOPBACK_CID_BASE + 1)
 #define CID_TIMEOUT (V4L2LOOPBACK_CID_BASE + 2)
 #define CID_TIMEOUT_IMAGE_IO (V4L2LOOPBACK_CID_BASE + 3)
+#define CID_LOSSLESS (V4L2LOOPBACK_CID_BASE + 4)
+/* per-opener controls */
+#define CID_LATEST_FRAME (V4L2LOOPBACK_CID_BASE + 5)
+#define CID_MAX_FRAME_AGE (V4L2LOOPBACK_CID_BASE + 6)
+#define CID_PIN_BUFFERS (V4L2LOOPBACK_CID_BASE + 7)
+#define CID_REWIND (V4L2LOOPBACK_CID_BASE + 8)
+#define CID_SEEK_SEQUENCE (V4L2LOOPBACK_CID_BASE + 9)
+#define CID_FRAME_METADATA (V4L2LOOPBACK_CID_BASE + 10)
+#define CID_DAMAGE (V4L2LOOPBACK_CID_BASE + 11)
+#define CID_METADATA_BUFFER (V4L2LOOPBACK_CID_BASE + 12)
+
+/* the seek controls act whenever they are set, not only on changes */
+#ifdef V4L2_CTRL_FLAG_EXECUTE_ON_WRITE
+#define V4L2L_CTRL_FLAG_ACTION V4L2_CTRL_FLAG_EXECUTE_ON_WRITE
+#else
+#define V4L2L_CTRL_FLAG_ACTION 0
+#endif
 
 static int v4l2loopback_s_ctrl(struct v4l2_ctrl *ctrl);
 static const struct v4l2_ctrl_ops v4l2loopback_ctrl_ops = {
 	.s_ctrl = v4l2loopback_s_ctrl,
 };
+static int v4l2loopback_opener_s_ctrl(struct v4l2_ctrl *ctrl);
+static int v4l2loopback_opener_g_volatile_ctrl(struct v4l2_ctrl *ctrl);
+static const struct v4l2_ctrl_ops v4l2loopback_opener_ctrl_ops = {
+	.g_volatile_ctrl = v4l2loopback_opener_g_volatile_ctrl,
+	.s_ctrl = v4l2loopback_opener_s_ctrl,
+};
 static const struct v4l2_ctrl_config v4l2loopback_ctrl_keepformat = {
 	// clang-format off
 	.ops	= &v4l2loopback_ctrl_ops,
@@ -294,6 +412,123 @@ static const struct v4l2_ctrl_config v4l2loopback_ctrl_timeoutimageio = {
 	.def	= 0,
 	// clang-format on
 };
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_lossless = {
+	// clang-format off
+	.ops	= &v4l2loopback_ctrl_ops,
+	.id	= CID_LOSSLESS,
+	.name	= "lossless",
+	.type	= V4L2_CTRL_TYPE_BOOLEAN,
+	.min	= 0,
+	.max	= 1,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_latestframe = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_LATEST_FRAME,
+	.name	= "latest_frame",
+	.type	= V4L2_CTRL_TYPE_BOOLEAN,
+	.min	= 0,
+	.max	= 1,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_maxframeage = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_MAX_FRAME_AGE,
+	.name	= "max_frame_age",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= 0,
+	.max	= MAX_TIMEOUT * 1000, /* in usecs */
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_pinbuffers = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_PIN_BUFFERS,
+	.name	= "pin_buffers",
+	.type	= V4L2_CTRL_TYPE_BOOLEAN,
+	.min	= 0,
+	.max	= 1,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_rewind = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_REWIND,
+	.name	= "rewind",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= 0,
+	.max	= MAX_BUFFERS - 1, /* in frames */
+	.step	= 1,
+	.def	= 0,
+	.flags	= V4L2L_CTRL_FLAG_ACTION,
+	// clang-format on
+};
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_seeksequence = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_SEEK_SEQUENCE,
+	.name	= "seek_sequence",
+	.type	= V4L2_CTRL_TYPE_INTEGER64,
+	.min	= 0,
+	.max	= U32_MAX, /* as in v4l2_buffer.sequence */
+	.step	= 1,
+	.def	= 0,
+	.flags	= V4L2L_CTRL_FLAG_ACTION,
+	// clang-format on
+};
+#ifdef HAVE_FRAME_METADATA
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_framemetadata = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_FRAME_METADATA,
+	.name	= "frame_metadata",
+	.type	= V4L2_CTRL_TYPE_U8,
+	.min	= 0,
+	.max	= 0xff,
+	.step	= 1,
+	.def	= 0,
+	.dims	= { V4L2LOOPBACK_META_SIZE },
+	.flags	= V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+	// clang-format on
+};
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_metadatabuffer = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_METADATA_BUFFER,
+	.name	= "metadata_buffer",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= 0,
+	.max	= MAX_BUFFERS - 1, /* buffer index */
+	.step	= 1,
+	.def	= 0,
+	.flags	= V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+	// clang-format on
+};
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_damage = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_DAMAGE,
+	.name	= "damage",
+	.type	= V4L2_CTRL_TYPE_U32,
+	.min	= 0,
+	.max	= U32_MAX,
+	.step	= 1,
+	.def	= 0,
+	.dims	= { V4L2LOOPBACK_MAX_DAMAGE, 4 }, /* left, top, width, height */
+	.flags	= V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+	// clang-format on
+};
+#endif /* HAVE_FRAME_METADATA */
 
 /* module structures */
 struct v4l2loopback_private {
@@ -308,8 +543,65 @@ struct v4l2l_buffer {
 	struct v4l2_buffer buffer;
 	struct list_head list_head;
 	int use_count;
+	u8 *vaddr; /* the buffer's data, `buffer_size` bytes; allocated on first
+		    * use, see get_buffer_data() */
+	s64 position; /* sequence number of the frame it holds; -1 if none */
+	ktime_t written; /* when that frame was written */
+	bool filling; /* handed to the producer and not queued back yet */
+	int pin_count; /* number of consumers holding it dequeued, see
+			* CID_PIN_BUFFERS */
+	u8 meta[V4L2LOOPBACK_META_SIZE]; /* metadata of the frame it holds,
+					  * see CID_FRAME_METADATA */
+	struct v4l2_rect damage[V4L2LOOPBACK_MAX_DAMAGE]; /* what changed
+							   * since the previous
+							   * frame */
+	int damage_count; /* -1 if unknown (all of it), see CID_DAMAGE */
+#ifdef HAVE_HUGEPAGES
+	struct page **huge_pages; /* compound pages behind `vaddr`, or NULL if
+				   * it was vmalloc'd */
+	u32 huge_count;
+#endif
+};
+
+/* a timer armed with absolute CLOCK_MONOTONIC deadlines */
+struct v4l2l_timer {
+#ifdef HAVE_HRTIMER_SOFT
+	struct hrtimer timer;
+#else
+	struct timer_list timer;
+#endif
 };
 
+static inline bool v4l2l_timer_pending(struct v4l2l_timer *t)
+{
+#ifdef HAVE_HRTIMER_SOFT
+	return hrtimer_is_queued(&t->timer);
+#else
+	return timer_pending(&t->timer);
+#endif
+}
+
+static inline void v4l2l_timer_start(struct v4l2l_timer *t, ktime_t expires)
+{
+#ifdef HAVE_HRTIMER_SOFT
+	hrtimer_start(&t->timer, expires, HRTIMER_MODE_ABS_SOFT);
+#else
+	s64 delta = ktime_to_ns(ktime_sub(expires, ktime_get()));
+	/* round up, so the timer never fires before `expires` */
+	mod_timer(&t->timer,
+		  jiffies + nsecs_to_jiffies(max_t(s64, delta, 0)) + 1);
+#endif
+}
+
+static inline void v4l2l_timer_cancel(struct v4l2l_timer *t)
+{
+#ifdef HAVE_HRTIMER_SOFT
+	hrtimer_cancel(&t->timer);
+#else
+	del_timer_sync(&t->timer);
+#endif
+}
+
 struct v4l2_loopback_device {
 	struct v4l2_device v4l2_dev;
 	struct v4l2_ctrl_handler ctrl_handler;
@@ -321,6 +613,7 @@ struct v4l2_loopback_device {
 				 * when true; else announce OUTPUT when no
 				 * writer is streaming, otherwise CAPTURE. */
 	int max_openers; /* how many times can this device be opened */
+	bool hugepages; /* back buffers with huge pages (if possible) */
 	int min_width, max_width;
 	int min_height, max_height;
 
@@ -328,7 +621,7 @@ struct v4l2_loopback_device {
 	struct v4l2_pix_format pix_format;
 	bool pix_format_has_valid_sizeimage;
 	struct v4l2_captureparm capture_param;
-	unsigned long frame_jiffies;
+	u64 frame_ns; /* nominal frame interval, from `capture_param` */
 
 	/* ctrls */
 	int keep_format; /* CID_KEEP_FORMAT; lock the format, do not free
@@ -337,45 +630,62 @@ struct v4l2_loopback_device {
 			  * `keep_format` to attach a new writer) */
 	int sustain_framerate; /* CID_SUSTAIN_FRAMERATE; duplicate frames to maintain
 				  (close to) nominal framerate */
-	unsigned long timeout_jiffies; /* CID_TIMEOUT; 0 means disabled */
+	u64 timeout_ns; /* CID_TIMEOUT; 0 means disabled */
 	int timeout_image_io; /* CID_TIMEOUT_IMAGE_IO; next opener will
 			       * queue/dequeue the timeout image buffer */
+	int lossless; /* CID_LOSSLESS; the producer waits for the consumer to
+		       * read a frame before its buffer is handed out again */
 
 	/* buffers for OUTPUT and CAPTURE */
-	u8 *image; /* pointer to actual buffers data */
-	unsigned long image_size; /* number of bytes alloc'd for all buffers */
 	struct v4l2l_buffer buffers[MAX_BUFFERS]; /* inner driver buffers */
 	u32 buffer_count; /* should not be big, 4 is a good choice */
-	u32 buffer_size; /* number of bytes alloc'd per buffer */
+	u32 buffer_size; /* number of bytes alloc'd per buffer; 0 while the
+			  * buffers are not allocated */
+	int ring_use_count; /* number of mappings of the entire ring */
 	u32 used_buffer_count; /* number of buffers allocated to openers */
 	struct list_head outbufs_list; /* FIFO queue for OUTPUT buffers */
 	u32 bufpos2index[MAX_BUFFERS]; /* mapping of `(position % used_buffers)`
 					* to `buffers[index]` */
+	u32 *status; /* the sequence number of the frame in each buffer, as
+		      * mapped by V4L2LOOPBACK_STATUS_OFFSET */
 	s64 write_position; /* sequence number of last 'displayed' buffer plus
 			     * one */
+	ktime_t publish_time; /* when the last frame (or duplicate) was
+			       * published */
+	s64 keyframe_position; /* sequence number of the newest keyframe; -1
+				* if none */
+	seqcount_t head_seq; /* publishes `write_position`, `bufpos2index`,
+			      * `publish_time`, `reread_count`,
+			      * `timeout_count` and `keyframe_position` to
+			      * readers; written under `lock` */
 
 	/* synchronization between openers */
 	atomic_t open_count;
 	struct mutex image_mutex; /* mutex for allocating image(s) and
-				   * exchanging format tokens */
-	spinlock_t lock; /* lock for the timeout and framerate timers */
-	spinlock_t list_lock; /* lock for the OUTPUT buffer queue */
-	wait_queue_head_t read_event;
+				   * exchanging format tokens; taken before
+				   * `lock`, never while holding it */
+	spinlock_t lock; /* lock for the OUTPUT buffer queue, the ring head and
+			  * the timeout and framerate timers */
+	struct list_head openers; /* all openers, for waking up readers; under
+				   * `lock` */
+	wait_queue_head_t write_event; /* woken when a consumer is done with a
+					* frame (in lossless mode) */
 	u32 format_tokens; /* tokens to 'set format' for OUTPUT, CAPTURE, or
 			    * timeout buffers */
 	u32 stream_tokens; /* tokens to 'start' OUTPUT, CAPTURE, or timeout
 			    * stream */
 
 	/* sustain framerate */
-	struct timer_list sustain_timer;
+	struct v4l2l_timer sustain_timer;
 	unsigned int reread_count;
+	ktime_t last_write; /* when the last frame was written */
 
 	/* timeout */
 	u8 *timeout_image; /* copied to outgoing buffers when timeout passes */
 	struct v4l2l_buffer timeout_buffer;
 	u32 timeout_buffer_size; /* number bytes alloc'd for timeout buffer */
-	struct timer_list timeout_timer;
-	int timeout_happened;
+	struct v4l2l_timer timeout_timer;
+	unsigned int timeout_count; /* number of timeouts that passed */
 };
 
 enum v4l2l_io_method {
@@ -385,6 +695,16 @@ enum v4l2l_io_method {
 	V4L2L_IO_TIMEOUT = 3,
 };
 
+/* userspace memory an opener queued for a buffer plane (when not using
+ * MMAP) */
+struct v4l2l_user_buffer {
+	union {
+		unsigned long userptr;
+		s32 fd;
+	} m;
+	u32 length;
+};
+
 /* struct keeping state and type of opener */
 struct v4l2_loopback_opener {
 	u32 format_token; /* token (if any) for type used in call to S_FMT or
@@ -392,14 +712,59 @@ struct v4l2_loopback_opener {
 	u32 stream_token; /* token (if any) for type used in call to STREAMON */
 	u32 buffer_count; /* number of buffers (if any) that opener acquired via
 			   * REQBUFS */
+	u32 memory; /* V4L2_MEMORY_* type of the buffers acquired via REQBUFS */
+	struct v4l2l_user_buffer user_buffers[MAX_BUFFERS][MAX_PLANES];
+	/* USERPTR capture buffers queued for filling, handed out round-robin
+	 * starting at next_user_buffer */
+	DECLARE_BITMAP(user_queued, MAX_BUFFERS);
+	u32 next_user_buffer;
 	s64 read_position; /* sequence number of the next 'captured' frame */
 	unsigned int reread_count;
+	spinlock_t read_lock; /* serialises reading `read_position` and
+			       * `reread_count` with seeking (from another
+			       * thread, via the controls) */
+	unsigned int timeout_count; /* last seen `dev->timeout_count` */
 	enum v4l2l_io_method io_method;
+	struct list_head node; /* entry in `dev->openers` */
+	wait_queue_head_t read_event; /* woken when a frame can be read */
+
+	/* per-opener controls (which include the device's controls) */
+	struct v4l2_ctrl_handler ctrl_handler;
+	int latest_frame; /* CID_LATEST_FRAME; always capture the newest frame,
+			   * dropping any older ones */
+	int max_frame_age; /* CID_MAX_FRAME_AGE; skip frames written more than
+			    * this many usecs ago; 0 means disabled */
+	int pin_buffers; /* CID_PIN_BUFFERS; the producer does not get buffers
+			  * back while they are dequeued by this opener */
+	DECLARE_BITMAP(pinned, MAX_BUFFERS); /* buffers pinned by the opener */
+	bool wait_keyframe; /* skip frames up to the next keyframe, as it joined
+			     * a compressed stream too late to start at one */
+	u8 meta[V4L2LOOPBACK_META_SIZE]; /* CID_FRAME_METADATA; to attach to the
+					  * frames it writes */
+	u8 read_meta[V4L2LOOPBACK_META_SIZE]; /* of the frame it read last */
+	/* CID_FRAME_METADATA of the frames it read, by (its) buffer index;
+	 * MAX_BUFFERS entries, allocated for consumers only (see
+	 * alloc_buffer_meta()) */
+	u8 (*buffer_meta)[V4L2LOOPBACK_META_SIZE];
+	int meta_buffer; /* CID_METADATA_BUFFER; which of them to report; -1
+			  * (until it reads a frame) for its own `meta` */
+	/* CID_DAMAGE; what changed in the next frame it writes (-1: unknown),
+	 * or in the frame it read last, since `damage_position` */
+	struct v4l2_rect damage[V4L2LOOPBACK_MAX_DAMAGE];
+	int damage_count;
+	s64 damage_position; /* the frame read before; -1 if none */
+
+	/* frame rate requested via S_PARM(CAPTURE); 0 to follow the device */
+	struct v4l2_fract timeperframe;
+	u64 frame_ns;
+	ktime_t next_tick; /* when the opener wants its next frame */
 
 	struct v4l2_fh fh;
 };
 
 #define fh_to_opener(ptr) container_of((ptr), struct v4l2_loopback_opener, fh)
+/* whether the opener only wants some of the frames, at its own frame rate */
+#define decimating(dev, opener) ((opener)->frame_ns > (dev)->frame_ns)
 
 /* this is heavily inspired by the bttv driver found in the linux kernel */
 struct v4l2l_format {
@@ -411,6 +776,8 @@ struct v4l2l_format {
 /* set the v4l2l_format.flags to PLANAR for non-packed formats */
 #define FORMAT_FLAGS_PLANAR 0x01
 #define FORMAT_FLAGS_COMPRESSED 0x02
+/* set for formats with several memory planes (multi-planar API only) */
+#define FORMAT_FLAGS_MPLANE 0x04
 
 #include "v4l2loopback_formats.h"
 
@@ -451,7 +818,20 @@ struct v4l2l_format {
 #define has_other_owners(opener, dev) \
 	(~((dev)->format_tokens ^ (opener)->format_token) & V4L2L_TOKEN_MASK)
 #define need_timeout_buffer(dev, token) \
-	((dev)->timeout_jiffies > 0 || (token) & V4L2L_TOKEN_TIMEOUT)
+	((dev)->timeout_ns > 0 || (token) & V4L2L_TOKEN_TIMEOUT)
+
+/* buffer types handled by the streaming ioctls */
+#ifdef HAVE_MPLANE
+#define is_video_type(type)                          \
+	((type) == V4L2_BUF_TYPE_VIDEO_CAPTURE ||        \
+	 (type) == V4L2_BUF_TYPE_VIDEO_OUTPUT ||         \
+	 (type) == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE || \
+	 (type) == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+#else
+#define is_video_type(type)                   \
+	((type) == V4L2_BUF_TYPE_VIDEO_CAPTURE || \
+	 (type) == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+#endif
 
 static const unsigned int FORMATS = ARRAY_SIZE(formats);
 
@@ -480,6 +860,21 @@ static const struct v4l2l_format *format_by_fourcc(int fourcc)
 	return NULL;
 }
 
+/* the `index`th format available through the API of buffer type `type` */
+static const struct v4l2l_format *format_by_index(u32 type, u32 index)
+{
+	unsigned int i;
+
+	for (i = 0; i < FORMATS; i++) {
+		if ((formats[i].flags & FORMAT_FLAGS_MPLANE) &&
+		    !V4L2_TYPE_IS_MULTIPLANAR(type))
+			continue;
+		if (index-- == 0)
+			return formats + i;
+	}
+	return NULL;
+}
+
 static void pix_format_set_size(struct v4l2_pix_format *f,
 				const struct v4l2l_format *fmt,
 				unsigned int width, unsigned int height)
@@ -500,6 +895,93 @@ static void pix_format_set_size(struct v4l2_pix_format *f,
 	}
 }
 
+/* where the planes of a frame live within an inner buffer
+ * formats with several memory planes start each plane on a page boundary, so
+ * the planes can be mapped (and exported) separately */
+struct v4l2l_planes {
+	u32 count;
+	u32 offset[MAX_PLANES];
+	u32 size[MAX_PLANES];
+	u32 bytesperline[MAX_PLANES];
+};
+
+static void pix_format_planes(const struct v4l2_pix_format *pix,
+			      struct v4l2l_planes *planes)
+{
+#ifdef HAVE_MPLANE
+	const struct v4l2_format_info *info = v4l2_format_info(pix->pixelformat);
+	struct v4l2_pix_format_mplane mp;
+	u32 i, offset = 0;
+
+	if (info && info->mem_planes > 1 && info->mem_planes <= MAX_PLANES &&
+	    !v4l2_fill_pixfmt_mp(&mp, pix->pixelformat, pix->width,
+				 pix->height)) {
+		planes->count = mp.num_planes;
+		for (i = 0; i < mp.num_planes; ++i) {
+			planes->offset[i] = offset;
+			planes->size[i] = mp.plane_fmt[i].sizeimage;
+			planes->bytesperline[i] = mp.plane_fmt[i].bytesperline;
+			offset += PAGE_ALIGN(planes->size[i]);
+		}
+		return;
+	}
+#endif
+	planes->count = 1;
+	planes->offset[0] = 0;
+	planes->size[0] = pix->sizeimage;
+	planes->bytesperline[0] = pix->bytesperline;
+}
+
+#ifdef HAVE_MPLANE
+static void pix_format_to_mplane(const struct v4l2_pix_format *pix,
+				 struct v4l2_pix_format_mplane *mp)
+{
+	struct v4l2l_planes planes;
+	u32 i;
+
+	pix_format_planes(pix, &planes);
+	memset(mp, 0, sizeof(*mp));
+	mp->width = pix->width;
+	mp->height = pix->height;
+	mp->pixelformat = pix->pixelformat;
+	mp->field = pix->field;
+	mp->colorspace = pix->colorspace;
+	mp->num_planes = planes.count;
+	for (i = 0; i < planes.count; ++i) {
+		mp->plane_fmt[i].sizeimage = planes.size[i];
+		mp->plane_fmt[i].bytesperline = planes.bytesperline[i];
+	}
+}
+
+/* the single-planar description of a multi-planar format covers all planes,
+ * laid out as in pix_format_planes() */
+static void pix_format_from_mplane(const struct v4l2_pix_format_mplane *mp,
+				   struct v4l2_pix_format *pix)
+{
+	u32 i;
+
+	memset(pix, 0, sizeof(*pix));
+	pix->width = mp->width;
+	pix->height = mp->height;
+	pix->pixelformat = mp->pixelformat;
+	pix->field = mp->field;
+	pix->colorspace = mp->colorspace;
+	pix->bytesperline = mp->plane_fmt[0].bytesperline;
+	for (i = 0; i + 1 < mp->num_planes; ++i)
+		pix->sizeimage += PAGE_ALIGN(mp->plane_fmt[i].sizeimage);
+	pix->sizeimage += mp->plane_fmt[i].sizeimage;
+}
+
+/* whether a format can only be used through the multi-planar API */
+static bool needs_mplane(const struct v4l2_pix_format *pix)
+{
+	struct v4l2l_planes planes;
+
+	pix_format_planes(pix, &planes);
+	return planes.count > 1;
+}
+#endif /* HAVE_MPLANE */
+
 static int v4l2l_fill_format(struct v4l2_format *fmt, const u32 minwidth,
 			     const u32 maxwidth, const u32 minheight,
 			     const u32 maxheight)
@@ -522,20 +1004,38 @@ static int v4l2l_fill_format(struct v4l2_format *fmt, const u32 minwidth,
 		fmt0.fmt.pix.sizeimage = 0;
 	}
 
-	if (0) {
-		;
+	if (V4L2_TYPE_IS_MULTIPLANAR(fmt0.type)) {
+#ifdef HAVE_MPLANE
+		if (!v4l2_fill_pixfmt_mp(&fmt0.fmt.pix_mp, pixelformat, width,
+					 height)) {
+			if (fmt0.fmt.pix_mp.num_planes > MAX_PLANES)
+				return -EINVAL;
+		} else {
+			/* formats unknown to v4l2: a single plane */
+			const struct v4l2l_format *format =
+				format_by_fourcc(pixelformat);
+			struct v4l2_pix_format pix = {
+				.field = fmt0.fmt.pix_mp.field,
+				.colorspace = fmt0.fmt.pix_mp.colorspace,
+			};
+			if (!format)
+				return -EINVAL;
+			pix_format_set_size(&pix, format, width, height);
+			pix.pixelformat = format->fourcc;
+			pix_format_to_mplane(&pix, &fmt0.fmt.pix_mp);
+		}
+#else
+		return -EINVAL;
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
 	} else if (!v4l2_fill_pixfmt(&fmt0.fmt.pix, pixelformat, width,
 				     height)) {
 		;
-	} else if (!v4l2_fill_pixfmt_mp(&fmt0.fmt.pix_mp, pixelformat, width,
-					height)) {
-		;
 #endif
 	} else {
 		const struct v4l2l_format *format =
 			format_by_fourcc(pixelformat);
-		if (!format)
+		if (!format || (format->flags & FORMAT_FLAGS_MPLANE))
 			return -EINVAL;
 		pix_format_set_size(&fmt0.fmt.pix, format, width, height);
 		fmt0.fmt.pix.pixelformat = format->fourcc;
@@ -613,8 +1113,23 @@ static int pix_format_eq(const struct v4l2_pix_format *ref,
 	return result;
 }
 
-static void set_timeperframe(struct v4l2_loopback_device *dev,
-			     struct v4l2_fract *tpf)
+/* the current format, as seen through the API of `f->type` */
+static int get_format(struct v4l2_loopback_device *dev, struct v4l2_format *f)
+{
+#ifdef HAVE_MPLANE
+	if (V4L2_TYPE_IS_MULTIPLANAR(f->type)) {
+		pix_format_to_mplane(&dev->pix_format, &f->fmt.pix_mp);
+		return 0;
+	}
+	if (needs_mplane(&dev->pix_format))
+		return -EINVAL;
+#endif
+	f->fmt.pix = dev->pix_format;
+	return 0;
+}
+
+/* clamp a frame interval to the supported range */
+static void clamp_timeperframe(struct v4l2_fract *tpf)
 {
 	if (!tpf->denominator && !tpf->numerator) {
 		tpf->numerator = 1;
@@ -629,11 +1144,21 @@ static void set_timeperframe(struct v4l2_loopback_device *dev,
 		tpf->numerator = 1;
 		tpf->denominator = V4L2LOOPBACK_FPS_MAX;
 	}
+}
 
+static u64 timeperframe_to_ns(const struct v4l2_fract *tpf)
+{
+	return max_t(u64, 1,
+		     div_u64((u64)NSEC_PER_SEC * tpf->numerator,
+			     tpf->denominator));
+}
+
+static void set_timeperframe(struct v4l2_loopback_device *dev,
+			     struct v4l2_fract *tpf)
+{
+	clamp_timeperframe(tpf);
 	dev->capture_param.timeperframe = *tpf;
-	dev->frame_jiffies =
-		max(1UL, (msecs_to_jiffies(1000) * tpf->numerator) /
-				 tpf->denominator);
+	dev->frame_ns = timeperframe_to_ns(tpf);
 }
 
 static struct v4l2_loopback_device *v4l2loopback_cd2dev(struct device *cd);
@@ -740,6 +1265,47 @@ static ssize_t attr_store_maxopeners(struct device *cd,
 static DEVICE_ATTR(max_openers, S_IRUGO | S_IWUSR, attr_show_maxopeners,
 		   attr_store_maxopeners);
 
+static ssize_t attr_show_hugepages(struct device *cd,
+				  struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_cd2dev(cd);
+
+	if (!dev)
+		return -ENODEV;
+
+	return sprintf(buf, "%d\n", dev->hugepages);
+}
+
+static ssize_t attr_store_hugepages(struct device *cd,
+				   struct device_attribute *attr,
+				   const char *buf, size_t len)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_cd2dev(cd);
+	unsigned long curr = 0;
+	int result;
+
+	if (kstrtoul(buf, 0, &curr) || curr > 1)
+		return -EINVAL;
+	if (!dev)
+		return -ENODEV;
+
+	/* the buffer size depends on it, so it can only change while there
+	 * are no buffers */
+	result = mutex_lock_killable(&dev->image_mutex);
+	if (result < 0)
+		return result;
+	if (dev->buffer_size && dev->hugepages != curr)
+		result = -EBUSY;
+	else
+		dev->hugepages = curr;
+	mutex_unlock(&dev->image_mutex);
+
+	return result < 0 ? result : len;
+}
+
+static DEVICE_ATTR(hugepages, S_IRUGO | S_IWUSR, attr_show_hugepages,
+		   attr_store_hugepages);
+
 static ssize_t attr_show_state(struct device *cd, struct device_attribute *attr,
 			       char *buf)
 {
@@ -766,6 +1332,7 @@ static void v4l2loopback_remove_sysfs(struct video_device *vdev)
 		V4L2_SYSFS_DESTROY(format);
 		V4L2_SYSFS_DESTROY(buffers);
 		V4L2_SYSFS_DESTROY(max_openers);
+		V4L2_SYSFS_DESTROY(hugepages);
 		V4L2_SYSFS_DESTROY(state);
 		/* ... */
 	}
@@ -785,6 +1352,7 @@ static void v4l2loopback_create_sysfs(struct video_device *vdev)
 		V4L2_SYSFS_CREATE(format);
 		V4L2_SYSFS_CREATE(buffers);
 		V4L2_SYSFS_CREATE(max_openers);
+		V4L2_SYSFS_CREATE(hugepages);
 		V4L2_SYSFS_CREATE(state);
 		/* ... */
 	} while (0);
@@ -866,9 +1434,18 @@ static int allocate_buffers(struct v4l2_loopback_device *dev,
 static void init_buffers(struct v4l2_loopback_device *dev, u32 bytes_used,
 			 u32 buffer_size);
 static void free_buffers(struct v4l2_loopback_device *dev);
+static u8 *allocate_buffer_data(struct v4l2_loopback_device *dev,
+				struct v4l2l_buffer *bufd);
+static u8 *get_buffer_data(struct v4l2_loopback_device *dev,
+			   struct v4l2l_buffer *bufd);
 static int allocate_timeout_buffer(struct v4l2_loopback_device *dev);
 static void free_timeout_buffer(struct v4l2_loopback_device *dev);
 static void check_timers(struct v4l2_loopback_device *dev);
+static void wake_up_readers(struct v4l2_loopback_device *dev);
+#ifdef HAVE_DMABUF
+static int import_dmabuf(u8 *addr, u32 size, struct v4l2_buffer *buf,
+			 u32 offset);
+#endif
 static const struct v4l2_file_operations v4l2_loopback_fops;
 static const struct v4l2_ioctl_ops v4l2_loopback_ioctl_ops;
 
@@ -899,6 +1476,18 @@ static int vidioc_querycap(struct file *file, void *fh,
 		} else
 			capabilities |= V4L2_CAP_VIDEO_CAPTURE;
 	}
+#ifdef HAVE_MPLANE
+	/* v4l2 enumerates formats for either the single- or the multi-planar
+	 * API; announce the latter when the format needs it */
+	if (needs_mplane(&dev->pix_format)) {
+		if (capabilities & V4L2_CAP_VIDEO_CAPTURE)
+			capabilities ^= V4L2_CAP_VIDEO_CAPTURE |
+					V4L2_CAP_VIDEO_CAPTURE_MPLANE;
+		if (capabilities & V4L2_CAP_VIDEO_OUTPUT)
+			capabilities ^= V4L2_CAP_VIDEO_OUTPUT |
+					V4L2_CAP_VIDEO_OUTPUT_MPLANE;
+	}
+#endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
 	dev->vdev->device_caps =
@@ -968,19 +1557,22 @@ static int check_buffer_capability(struct v4l2_loopback_device *dev,
 	if (opener->io_method == V4L2L_IO_TIMEOUT)
 		return 0;
 	if (dev->announce_all_caps)
-		return (type == V4L2_BUF_TYPE_VIDEO_CAPTURE ||
-			type == V4L2_BUF_TYPE_VIDEO_OUTPUT) ?
-			       0 :
-			       -EINVAL;
+		return is_video_type(type) ? 0 : -EINVAL;
 	/* CAPTURE if opener has a capture format or a writer is streaming;
 	 * else OUTPUT. */
 	switch (type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+#endif
 		if (!(has_capture_token(opener->format_token) ||
 		      !has_output_token(dev->stream_tokens)))
 			return -EINVAL;
 		break;
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+#endif
 		if (!(has_output_token(opener->format_token) ||
 		      has_output_token(dev->stream_tokens)))
 			return -EINVAL;
@@ -1053,10 +1645,15 @@ static int vidioc_enum_fmt_vid(struct file *file, void *fh,
 	if (fixed && f->index)
 		return -EINVAL;
 
-	fmt = fixed ? format_by_fourcc(dev->pix_format.pixelformat) :
-		      &formats[f->index];
-	if (!fmt)
-		return -EFAULT;
+	if (fixed) {
+		fmt = format_by_fourcc(dev->pix_format.pixelformat);
+		if (!fmt)
+			return -EFAULT;
+	} else {
+		fmt = format_by_index(f->type, f->index);
+		if (!fmt)
+			return -EINVAL;
+	}
 
 	f->flags = 0;
 	if (fmt->flags & FORMAT_FLAGS_COMPRESSED)
@@ -1083,7 +1680,7 @@ static int vidioc_try_fmt_vid(struct file *file, void *fh,
 		return -EINVAL;
 	if (dev->keep_format || has_other_owners(opener, dev))
 		/* use existing format - including colorspace info */
-		f->fmt.pix = dev->pix_format;
+		return get_format(dev, f);
 
 	return 0;
 }
@@ -1102,12 +1699,19 @@ static int vidioc_s_fmt_vid(struct file *file, void *fh, struct v4l2_format *f)
 	u32 token = opener->io_method == V4L2L_IO_TIMEOUT ?
 			    V4L2L_TOKEN_TIMEOUT :
 			    token_from_type(f->type);
+	struct v4l2_pix_format pix;
 	int changed, result;
 	char buf[5];
 
 	result = vidioc_try_fmt_vid(file, fh, f);
 	if (result < 0)
 		return result;
+#ifdef HAVE_MPLANE
+	if (V4L2_TYPE_IS_MULTIPLANAR(f->type))
+		pix_format_from_mplane(&f->fmt.pix_mp, &pix);
+	else
+#endif
+		pix = f->fmt.pix;
 
 	if (opener->buffer_count > 0)
 		/* must free buffers before format can be set */
@@ -1126,11 +1730,11 @@ static int vidioc_s_fmt_vid(struct file *file, void *fh, struct v4l2_format *f)
 
 	dprintk("S_FMT[%s] %4s:%ux%u size=%u\n",
 		V4L2_TYPE_IS_CAPTURE(f->type) ? "CAPTURE" : "OUTPUT",
-		fourcc2str(f->fmt.pix.pixelformat, buf), f->fmt.pix.width,
-		f->fmt.pix.height, f->fmt.pix.sizeimage);
-	changed = !pix_format_eq(&dev->pix_format, &f->fmt.pix, 0);
+		fourcc2str(pix.pixelformat, buf), pix.width, pix.height,
+		pix.sizeimage);
+	changed = !pix_format_eq(&dev->pix_format, &pix, 0);
 	if (changed || has_no_owners(dev)) {
-		result = allocate_buffers(dev, &f->fmt.pix);
+		result = allocate_buffers(dev, &pix);
 		if (result < 0)
 			goto exit_s_fmt_unlock;
 	}
@@ -1141,7 +1745,7 @@ static int vidioc_s_fmt_vid(struct file *file, void *fh, struct v4l2_format *f)
 			goto exit_s_fmt_free;
 	}
 	if (changed) {
-		dev->pix_format = f->fmt.pix;
+		dev->pix_format = pix;
 		dev->pix_format_has_valid_sizeimage =
 			v4l2l_pix_format_has_valid_sizeimage(f);
 	}
@@ -1172,8 +1776,7 @@ static int vidioc_g_fmt_cap(struct file *file, void *fh, struct v4l2_format *f)
 	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
 	if (check_buffer_capability(dev, opener, f->type) < 0)
 		return -EINVAL;
-	f->fmt.pix = dev->pix_format;
-	return 0;
+	return get_format(dev, f);
 }
 
 static int vidioc_try_fmt_cap(struct file *file, void *fh,
@@ -1210,8 +1813,7 @@ static int vidioc_g_fmt_out(struct file *file, void *fh, struct v4l2_format *f)
 	 * CHECK whether this assumption is wrong,
 	 * or whether we have to always provide a valid format
 	 */
-	f->fmt.pix = dev->pix_format;
-	return 0;
+	return get_format(dev, f);
 }
 
 static int vidioc_try_fmt_out(struct file *file, void *fh,
@@ -1263,6 +1865,8 @@ static int vidioc_g_parm(struct file *file, void *fh,
 	if (check_buffer_capability(dev, opener, parm->type) < 0)
 		return -EINVAL;
 	parm->parm.capture = dev->capture_param;
+	if (V4L2_TYPE_IS_CAPTURE(parm->type) && decimating(dev, opener))
+		parm->parm.capture.timeperframe = opener->timeperframe;
 	return 0;
 }
 
@@ -1284,9 +1888,22 @@ static int vidioc_s_parm(struct file *file, void *fh,
 
 	switch (parm->type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
-		set_timeperframe(dev, &parm->parm.capture.timeperframe);
-		break;
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+#endif
+		/* consumers only choose their own frame rate, which takes
+		 * effect when it is lower than the device's */
+		clamp_timeperframe(&parm->parm.capture.timeperframe);
+		opener->timeperframe = parm->parm.capture.timeperframe;
+		opener->frame_ns = timeperframe_to_ns(&opener->timeperframe);
+		opener->next_tick = 0;
+		parm->parm.capture = dev->capture_param;
+		parm->parm.capture.timeperframe = opener->timeperframe;
+		return 0;
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+#endif
 		set_timeperframe(dev, &parm->parm.output.timeperframe);
 		break;
 	default:
@@ -1381,19 +1998,26 @@ static int v4l2loopback_set_ctrl(struct v4l2_loopback_device *dev, u32 id,
 			if (result < 0) {
 				/* disable timeout as buffer not alloc'd */
 				spin_lock_bh(&dev->lock);
-				dev->timeout_jiffies = 0;
+				dev->timeout_ns = 0;
 				spin_unlock_bh(&dev->lock);
 				return result;
 			}
 		}
 		spin_lock_bh(&dev->lock);
-		dev->timeout_jiffies = msecs_to_jiffies(val);
+		dev->timeout_ns = (u64)val * NSEC_PER_MSEC;
 		check_timers(dev);
 		spin_unlock_bh(&dev->lock);
 		break;
 	case CID_TIMEOUT_IMAGE_IO:
 		dev->timeout_image_io = 1;
 		break;
+	case CID_LOSSLESS:
+		if (val < 0 || val > 1)
+			return -EINVAL;
+		dev->lossless = val;
+		/* a waiting producer need not wait any longer */
+		wake_up_all(&dev->write_event);
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -1407,30 +2031,228 @@ static int v4l2loopback_s_ctrl(struct v4l2_ctrl *ctrl)
 	return v4l2loopback_set_ctrl(dev, ctrl->id, ctrl->val);
 }
 
-/* returns set of device outputs, in our case there is only one
- * called on VIDIOC_ENUMOUTPUT
- */
-static int vidioc_enum_output(struct file *file, void *fh,
-			      struct v4l2_output *outp)
+static int seek_capture(struct v4l2_loopback_device *dev,
+			struct v4l2_loopback_opener *opener, s64 value,
+			bool relative);
+
+/* the area of a frame that (may have) changed, as a list of rectangles */
+static void set_full_damage(struct v4l2_loopback_device *dev,
+			    struct v4l2_rect *damage, int *count)
 {
-	__u32 index = outp->index;
-	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
-	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	damage[0].left = 0;
+	damage[0].top = 0;
+	damage[0].width = dev->pix_format.width;
+	damage[0].height = dev->pix_format.height;
+	*count = 1;
+}
 
-	if (check_buffer_capability(dev, opener, V4L2_BUF_TYPE_VIDEO_OUTPUT))
-		return -ENOTTY;
-	if (index)
-		return -EINVAL;
+/* add a rectangle to the list; if it is full, merge all of them into their
+ * bounding box */
+static void add_damage(struct v4l2_rect *damage, int *count,
+		       const struct v4l2_rect *rect)
+{
+	s32 right, bottom;
+	int i;
 
-	/* clear all data (including the reserved fields) */
-	memset(outp, 0, sizeof(*outp));
+	if (*count < V4L2LOOPBACK_MAX_DAMAGE) {
+		damage[(*count)++] = *rect;
+		return;
+	}
+	right = rect->left + rect->width;
+	bottom = rect->top + rect->height;
+	for (i = 0; i < *count; ++i) {
+		right = max_t(s32, right, damage[i].left + damage[i].width);
+		bottom = max_t(s32, bottom, damage[i].top + damage[i].height);
+		damage[0].left = min(damage[0].left, damage[i].left);
+		damage[0].top = min(damage[0].top, damage[i].top);
+	}
+	damage[0].left = min(damage[0].left, rect->left);
+	damage[0].top = min(damage[0].top, rect->top);
+	damage[0].width = right - damage[0].left;
+	damage[0].height = bottom - damage[0].top;
+	*count = 1;
+}
 
-	outp->index = index;
-	strscpy(outp->name, "loopback in", sizeof(outp->name));
-	outp->type = V4L2_OUTPUT_TYPE_ANALOG;
-	outp->audioset = 0;
-	outp->modulator = 0;
-#ifdef V4L2LOOPBACK_WITH_STD
+/* the damage of the next frame, as reported by the producer; entries without
+ * an area are unused */
+static void set_damage(struct v4l2_loopback_device *dev,
+		       struct v4l2_loopback_opener *opener, const u32 *rects)
+{
+	u32 width, height;
+	struct v4l2_rect rect;
+	int i;
+
+	spin_lock_bh(&dev->lock);
+	width = dev->pix_format.width;
+	height = dev->pix_format.height;
+	opener->damage_count = 0;
+	for (i = 0; i < V4L2LOOPBACK_MAX_DAMAGE; ++i, rects += 4) {
+		if (rects[0] >= width || rects[1] >= height)
+			continue;
+		rect.left = rects[0];
+		rect.top = rects[1];
+		rect.width = min(rects[2], width - rects[0]);
+		rect.height = min(rects[3], height - rects[1]);
+		if (rect.width && rect.height)
+			add_damage(opener->damage, &opener->damage_count,
+				   &rect);
+	}
+	spin_unlock_bh(&dev->lock);
+}
+
+/* the damage as the opener sees it; if unknown (before the first frame, or
+ * after the producer queued one), that is all of the frame, as no rectangles
+ * at all would mean that nothing changed */
+static void get_damage(struct v4l2_loopback_device *dev,
+		       struct v4l2_loopback_opener *opener, u32 *rects)
+{
+	int i;
+
+	memset(rects, 0, V4L2LOOPBACK_MAX_DAMAGE * 4 * sizeof(*rects));
+	spin_lock_bh(&dev->lock);
+	if (opener->damage_count < 0) {
+		rects[2] = dev->pix_format.width;
+		rects[3] = dev->pix_format.height;
+	}
+	for (i = 0; i < opener->damage_count; ++i, rects += 4) {
+		rects[0] = opener->damage[i].left;
+		rects[1] = opener->damage[i].top;
+		rects[2] = opener->damage[i].width;
+		rects[3] = opener->damage[i].height;
+	}
+	spin_unlock_bh(&dev->lock);
+}
+
+static int v4l2loopback_opener_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct v4l2_loopback_opener *opener = container_of(
+		ctrl->handler, struct v4l2_loopback_opener, ctrl_handler);
+	struct v4l2_loopback_device *dev =
+		v4l2loopback_cd2dev(&opener->fh.vdev->dev);
+
+	switch (ctrl->id) {
+	case CID_LATEST_FRAME:
+		opener->latest_frame = ctrl->val;
+		break;
+	case CID_MAX_FRAME_AGE:
+		opener->max_frame_age = ctrl->val;
+		break;
+	case CID_PIN_BUFFERS:
+		opener->pin_buffers = ctrl->val;
+		break;
+	case CID_REWIND:
+		return seek_capture(dev, opener, ctrl->val, true);
+	case CID_SEEK_SEQUENCE:
+		return seek_capture(dev, opener, ctrl->val64, false);
+#ifdef HAVE_FRAME_METADATA
+	case CID_FRAME_METADATA:
+		memcpy(opener->meta, ctrl->p_new.p_u8, sizeof(opener->meta));
+		break;
+	case CID_DAMAGE:
+		set_damage(dev, opener, ctrl->p_new.p_u32);
+		break;
+	case CID_METADATA_BUFFER:
+		spin_lock_bh(&dev->lock);
+		opener->meta_buffer = ctrl->val;
+		spin_unlock_bh(&dev->lock);
+		break;
+#endif
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int v4l2loopback_opener_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct v4l2_loopback_opener *opener = container_of(
+		ctrl->handler, struct v4l2_loopback_opener, ctrl_handler);
+	struct v4l2_loopback_device *dev =
+		v4l2loopback_cd2dev(&opener->fh.vdev->dev);
+
+	switch (ctrl->id) {
+#ifdef HAVE_FRAME_METADATA
+	case CID_FRAME_METADATA:
+		/* (the opener may be dequeuing another frame meanwhile) */
+		spin_lock_bh(&dev->lock);
+		memcpy(ctrl->p_new.p_u8,
+		       opener->meta_buffer < 0 || !opener->buffer_meta ?
+			       opener->meta :
+			       opener->buffer_meta[opener->meta_buffer],
+		       sizeof(opener->meta));
+		spin_unlock_bh(&dev->lock);
+		break;
+	case CID_METADATA_BUFFER:
+		ctrl->val = max(opener->meta_buffer, 0);
+		break;
+	case CID_DAMAGE:
+		get_damage(dev, opener, ctrl->p_new.p_u32);
+		break;
+#endif
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* set up the opener's own control handler, which also exposes the device's
+ * controls */
+static int init_opener_ctrls(struct v4l2_loopback_device *dev,
+			     struct v4l2_loopback_opener *opener)
+{
+	struct v4l2_ctrl_handler *hdl = &opener->ctrl_handler;
+	int err;
+
+	err = v4l2_ctrl_handler_init(hdl, 8);
+	if (err)
+		return err;
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_latestframe, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_maxframeage, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_pinbuffers, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_rewind, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_seeksequence, NULL);
+#ifdef HAVE_FRAME_METADATA
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_framemetadata, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_damage, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_metadatabuffer, NULL);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	v4l2_ctrl_add_handler(hdl, &dev->ctrl_handler, NULL, false);
+#else
+	v4l2_ctrl_add_handler(hdl, &dev->ctrl_handler, NULL);
+#endif
+	if (hdl->error) {
+		err = hdl->error;
+		v4l2_ctrl_handler_free(hdl);
+		return err;
+	}
+	return 0;
+}
+
+/* returns set of device outputs, in our case there is only one
+ * called on VIDIOC_ENUMOUTPUT
+ */
+static int vidioc_enum_output(struct file *file, void *fh,
+			      struct v4l2_output *outp)
+{
+	__u32 index = outp->index;
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+
+	if (check_buffer_capability(dev, opener, V4L2_BUF_TYPE_VIDEO_OUTPUT))
+		return -ENOTTY;
+	if (index)
+		return -EINVAL;
+
+	/* clear all data (including the reserved fields) */
+	memset(outp, 0, sizeof(*outp));
+
+	outp->index = index;
+	strscpy(outp->name, "loopback in", sizeof(outp->name));
+	outp->type = V4L2_OUTPUT_TYPE_ANALOG;
+	outp->audioset = 0;
+	outp->modulator = 0;
+#ifdef V4L2LOOPBACK_WITH_STD
 	outp->std = V4L2_STD_ALL;
 #ifdef V4L2_OUT_CAP_STD
 	outp->capabilities |= V4L2_OUT_CAP_STD;
@@ -1565,6 +2387,10 @@ static int vidioc_s_input(struct file *file, void *fh, unsigned int index)
 		flags &= ~V4L2_BUF_FLAG_QUEUED; \
 		flags |= V4L2_BUF_FLAG_DONE;    \
 	} while (0)
+/* per-frame flags, as queued by the producer and passed on to consumers */
+#define V4L2L_FRAME_FLAGS                                                  \
+	(V4L2_BUF_FLAG_KEYFRAME | V4L2_BUF_FLAG_PFRAME | V4L2_BUF_FLAG_BFRAME | \
+	 V4L2_BUF_FLAG_TIMECODE)
 
 static bool any_buffers_mapped(struct v4l2_loopback_device *dev)
 {
@@ -1575,16 +2401,347 @@ static bool any_buffers_mapped(struct v4l2_loopback_device *dev)
 	return false;
 }
 
+/* which memory types an opener may use for a buffer type */
+static bool supports_memory(struct v4l2_loopback_opener *opener, u32 type,
+			    u32 memory)
+{
+	if (V4L2_TYPE_IS_MULTIPLANAR(type) &&
+	    opener->io_method == V4L2L_IO_TIMEOUT)
+		/* the timeout image is single-planar */
+		return false;
+	switch (memory) {
+	case V4L2_MEMORY_MMAP:
+		return true;
+	case V4L2_MEMORY_USERPTR:
+		/* copied into the inner buffers on QBUF (OUTPUT) or
+		 * out of them on DQBUF (CAPTURE) */
+		return opener->io_method != V4L2L_IO_TIMEOUT;
+#ifdef HAVE_DMABUF
+	case V4L2_MEMORY_DMABUF:
+		/* imported into the inner buffers on QBUF */
+		return V4L2_TYPE_IS_OUTPUT(type) &&
+		       opener->io_method != V4L2L_IO_TIMEOUT;
+#endif
+	default:
+		return false;
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+static u32 buffer_capabilities(struct v4l2_loopback_opener *opener, u32 type)
+{
+	u32 caps = 0;
+
+	if (supports_memory(opener, type, V4L2_MEMORY_MMAP))
+		caps |= V4L2_BUF_CAP_SUPPORTS_MMAP;
+	if (supports_memory(opener, type, V4L2_MEMORY_USERPTR))
+		caps |= V4L2_BUF_CAP_SUPPORTS_USERPTR;
+	if (supports_memory(opener, type, V4L2_MEMORY_DMABUF))
+		caps |= V4L2_BUF_CAP_SUPPORTS_DMABUF;
+	return caps;
+}
+#endif
+
+/* the planes of an inner buffer, as seen through the API of buffer type
+ * `type`; the single-planar API sees the whole buffer as one plane */
+static void get_planes(struct v4l2_loopback_device *dev, u32 type,
+		       struct v4l2l_planes *planes)
+{
+	if (V4L2_TYPE_IS_MULTIPLANAR(type)) {
+		pix_format_planes(&dev->pix_format, planes);
+		return;
+	}
+	planes->count = 1;
+	planes->offset[0] = 0;
+	planes->size[0] = dev->buffer_size;
+	planes->bytesperline[0] = dev->pix_format.bytesperline;
+}
+
+/* the planes an opener passed in `b`, checked against `layout`
+ * for the single-planar API, `single` is filled in from `b` */
+static struct v4l2_plane *get_user_planes(struct v4l2_buffer *b,
+					  const struct v4l2l_planes *layout,
+					  struct v4l2_plane *single)
+{
+	if (V4L2_TYPE_IS_MULTIPLANAR(b->type))
+		return b->length < layout->count ? NULL : b->m.planes;
+
+	memset(single, 0, sizeof(*single));
+	single->bytesused = b->bytesused;
+	single->length = b->length;
+	if (b->memory == V4L2_MEMORY_USERPTR)
+		single->m.userptr = b->m.userptr;
+	else if (b->memory == V4L2_MEMORY_DMABUF)
+		single->m.fd = b->m.fd;
+	else
+		single->m.mem_offset = b->m.offset;
+	return single;
+}
+
+/* whether a multi-planar buffer `b` has room for all planes */
+static bool has_planes(struct v4l2_loopback_device *dev,
+		       const struct v4l2_buffer *b)
+{
+	struct v4l2l_planes layout;
+
+	if (!V4L2_TYPE_IS_MULTIPLANAR(b->type))
+		return true;
+	get_planes(dev, b->type, &layout);
+	return b->m.planes && b->length >= layout.count;
+}
+
+/* fill in the memory-specific fields of inner buffer `b` handed to the
+ * opener; `planes` receives the per-plane fields of the multi-planar API */
+static void set_buffer_memory(struct v4l2_loopback_device *dev,
+			      struct v4l2_loopback_opener *opener,
+			      struct v4l2_buffer *b, u32 type,
+			      struct v4l2_plane *planes)
+{
+	const struct v4l2l_user_buffer *ubuf = NULL;
+	struct v4l2l_planes layout;
+	struct v4l2_plane single;
+	u32 i;
+
+	if (opener->memory != V4L2_MEMORY_MMAP && b->index < MAX_BUFFERS) {
+		ubuf = opener->user_buffers[b->index];
+		b->memory = opener->memory;
+	}
+	get_planes(dev, type, &layout);
+	if (!V4L2_TYPE_IS_MULTIPLANAR(type))
+		planes = &single;
+
+	for (i = 0; i < layout.count; ++i) {
+		struct v4l2_plane *p = &planes[i];
+		u32 offset = layout.offset[i];
+
+		memset(p, 0, sizeof(*p));
+		p->length = layout.size[i];
+		if (ubuf) {
+			p->length = ubuf[i].length;
+			if (opener->memory == V4L2_MEMORY_USERPTR)
+				p->m.userptr = ubuf[i].m.userptr;
+			else
+				p->m.fd = ubuf[i].m.fd;
+		} else {
+			p->m.mem_offset = b->m.offset + offset;
+		}
+		if (b->bytesused > offset)
+			p->bytesused = min(b->bytesused - offset, p->length);
+	}
+
+	if (V4L2_TYPE_IS_MULTIPLANAR(type)) {
+		b->m.planes = planes;
+		b->length = layout.count;
+		b->bytesused = 0;
+	} else {
+		b->bytesused = single.bytesused;
+		if (!ubuf)
+			return;
+		if (opener->memory == V4L2_MEMORY_USERPTR)
+			b->m.userptr = single.m.userptr;
+		else
+			b->m.fd = single.m.fd;
+		b->length = single.length;
+	}
+}
+
+/* copy a plane queued from userspace memory into `addr` (at most `size`
+ * bytes), and remember the memory for handing it back on DQBUF
+ * this is a copy, not zero-copy: the user pages are not pinned and served to
+ * the consumers, whose mmap()s must stay backed by the ring's own pages */
+static int import_plane(struct v4l2l_user_buffer *ubuf, u8 *addr, u32 size,
+			u32 memory, struct v4l2_plane *plane)
+{
+	u32 count = plane->bytesused ? plane->bytesused : plane->length;
+	u32 offset = plane->data_offset;
+	int result = 0;
+
+	switch (memory) {
+	case V4L2_MEMORY_USERPTR:
+		if (!plane->m.userptr || count > plane->length ||
+		    offset > count)
+			return -EINVAL;
+		count = min(count - offset, size);
+		if (copy_from_user(addr,
+				   (void __user *)(plane->m.userptr + offset),
+				   count))
+			return -EFAULT;
+		ubuf->m.userptr = plane->m.userptr;
+		break;
+#ifdef HAVE_DMABUF
+	case V4L2_MEMORY_DMABUF: {
+		struct v4l2_buffer b = {
+			.bytesused = plane->bytesused,
+			.m.fd = plane->m.fd,
+		};
+		result = import_dmabuf(addr, size, &b, offset);
+		count = b.bytesused;
+		plane->length = b.length;
+		ubuf->m.fd = plane->m.fd;
+		break;
+	}
+#endif
+	default:
+		return -EINVAL;
+	}
+	if (result < 0)
+		return result;
+	plane->bytesused = count;
+	ubuf->length = plane->length;
+	return 0;
+}
+
+/* take the planes of an OUTPUT buffer: copy them into the inner buffer
+ * when queued from userspace memory (USERPTR or DMABUF), and sum up their
+ * bytesused in `buf->bytesused` */
+static int import_buffer(struct v4l2_loopback_device *dev,
+			 struct v4l2_loopback_opener *opener,
+			 struct v4l2l_buffer *bufd, struct v4l2_buffer *buf)
+{
+	struct v4l2l_user_buffer *ubuf = opener->user_buffers[buf->index];
+	struct v4l2l_planes layout;
+	struct v4l2_plane single, *planes;
+	u32 i, bytesused = 0;
+	u8 *addr;
+	int result;
+
+	get_planes(dev, buf->type, &layout);
+	planes = get_user_planes(buf, &layout, &single);
+	if (!planes)
+		return -EINVAL;
+
+	/* keep the inner buffer from being freed or re-allocated while the
+	 * planes are copied into it */
+	result = mutex_lock_killable(&dev->image_mutex);
+	if (result < 0)
+		return result; /* -EINTR */
+	addr = allocate_buffer_data(dev, bufd);
+	if (!addr) {
+		result = -ENOMEM;
+		goto exit_import_unlock;
+	}
+
+	for (i = 0; i < layout.count; ++i) {
+		struct v4l2_plane *p = &planes[i];
+
+		if (buf->memory == V4L2_MEMORY_MMAP) {
+			/* planes are laid out at fixed offsets */
+			if (p->data_offset) {
+				result = -EINVAL;
+				goto exit_import_unlock;
+			}
+			p->bytesused = min(p->bytesused, layout.size[i]);
+		} else {
+			result = import_plane(&ubuf[i],
+					      addr + layout.offset[i],
+					      layout.size[i], buf->memory, p);
+			if (result < 0)
+				goto exit_import_unlock;
+		}
+		if (p->bytesused)
+			bytesused = layout.offset[i] + p->bytesused;
+	}
+	buf->bytesused = bytesused;
+exit_import_unlock:
+	mutex_unlock(&dev->image_mutex);
+	return result;
+}
+
+/* remember the USERPTR planes queued by a capture opener */
+static int queue_userptr(struct v4l2_loopback_device *dev,
+			 struct v4l2_loopback_opener *opener,
+			 struct v4l2_buffer *buf)
+{
+	struct v4l2l_user_buffer *ubuf = opener->user_buffers[buf->index];
+	struct v4l2l_planes layout;
+	struct v4l2_plane single, *planes;
+	u32 i;
+
+	get_planes(dev, buf->type, &layout);
+	planes = get_user_planes(buf, &layout, &single);
+	if (!planes)
+		return -EINVAL;
+	for (i = 0; i < layout.count; ++i) {
+		if (!planes[i].m.userptr || !planes[i].length)
+			return -EINVAL;
+		ubuf[i].m.userptr = planes[i].m.userptr;
+		ubuf[i].length = planes[i].length;
+	}
+	set_bit(buf->index, opener->user_queued);
+	return 0;
+}
+
+/* copy the frame in inner buffer `index` into the next USERPTR buffer
+ * queued by a capture opener, and describe that buffer in `buf` */
+static int export_userptr(struct v4l2_loopback_device *dev,
+			  struct v4l2_loopback_opener *opener, u32 index,
+			  struct v4l2_buffer *buf)
+{
+	struct v4l2l_buffer *bufd = &dev->buffers[index];
+	struct v4l2_plane *planes = buf->m.planes;
+	struct v4l2l_user_buffer *ubuf;
+	struct v4l2l_planes layout;
+	u32 type = buf->type;
+	u32 uindex, i;
+	u8 *addr = get_buffer_data(dev, bufd);
+
+	if (!addr)
+		return -ENOMEM;
+	uindex = find_next_bit(opener->user_queued, MAX_BUFFERS,
+			       opener->next_user_buffer);
+	if (uindex >= MAX_BUFFERS)
+		uindex = find_first_bit(opener->user_queued, MAX_BUFFERS);
+	if (uindex >= MAX_BUFFERS)
+		return -EINVAL;
+	ubuf = opener->user_buffers[uindex];
+
+	*buf = bufd->buffer;
+	get_planes(dev, type, &layout);
+	for (i = 0; i < layout.count; ++i) {
+		u32 offset = layout.offset[i], count = 0;
+
+		if (bufd->buffer.bytesused > offset)
+			count = min(bufd->buffer.bytesused - offset,
+				    layout.size[i]);
+		if (count > ubuf[i].length) {
+			dprintkrw("DQBUF() user buffer too small "
+				  "[index=%u, plane=%u]: %u < %u\n",
+				  uindex, i, ubuf[i].length, count);
+			count = ubuf[i].length;
+			buf->flags |= V4L2_BUF_FLAG_ERROR;
+		}
+		if (copy_to_user((void __user *)ubuf[i].m.userptr,
+				 addr + offset, count))
+			return -EFAULT;
+	}
+
+	clear_bit(uindex, opener->user_queued);
+	opener->next_user_buffer = (uindex + 1) % MAX_BUFFERS;
+	buf->index = uindex;
+	set_buffer_memory(dev, opener, buf, type, planes);
+	return 0;
+}
+
 static void prepare_buffer_queue(struct v4l2_loopback_device *dev, int count)
 {
+	struct v4l2_loopback_opener *opener;
 	struct v4l2l_buffer *bufd, *n;
 	u32 pos;
 
-	spin_lock_bh(&dev->list_lock);
+	spin_lock_bh(&dev->lock);
+
+	/* the frames are gone, and so are the pins on them */
+	list_for_each_entry(opener, &dev->openers, node)
+		bitmap_zero(opener->pinned, MAX_BUFFERS);
+	for (pos = 0; pos < MAX_BUFFERS; ++pos)
+		dev->buffers[pos].pin_count = 0;
 
 	/* ensure sufficient number of buffers in queue */
 	for (pos = 0; pos < count; ++pos) {
 		bufd = &dev->buffers[pos];
+		bufd->position = -1;
+		bufd->filling = false;
+		WRITE_ONCE(dev->status[pos], V4L2LOOPBACK_SEQUENCE_INVALID);
 		if (list_empty(&bufd->list_head))
 			list_add_tail(&bufd->list_head, &dev->outbufs_list);
 	}
@@ -1599,19 +2756,28 @@ static void prepare_buffer_queue(struct v4l2_loopback_device *dev, int count)
 
 	/* buffers are no longer queued; and `write_position` will correspond
 	 * to the first item of `outbufs_list`. */
+	write_seqcount_begin(&dev->head_seq);
+	dev->keyframe_position = -1;
 	pos = v4l2l_mod64(dev->write_position, count);
 	list_for_each_entry(bufd, &dev->outbufs_list, list_head) {
 		unset_flags(bufd->buffer.flags);
 		dev->bufpos2index[pos % count] = bufd->buffer.index;
 		++pos;
 	}
+	write_seqcount_end(&dev->head_seq);
 exit_prepare_queue_unlock:
-	spin_unlock_bh(&dev->list_lock);
+	spin_unlock_bh(&dev->lock);
 }
 
-/* forward declaration */
+/* forward declarations */
 static int vidioc_streamoff(struct file *file, void *fh,
 			    enum v4l2_buf_type type);
+static void unpin_buffers(struct v4l2_loopback_device *dev,
+			  struct v4l2_loopback_opener *opener);
+static int alloc_buffer_meta(struct v4l2_loopback_device *dev,
+			     struct v4l2_loopback_opener *opener);
+static void free_buffer_meta(struct v4l2_loopback_device *dev,
+			     struct v4l2_loopback_opener *opener);
 /* negotiate buffer type
  * only mmap streaming supported
  * called on VIDIOC_REQBUFS
@@ -1632,18 +2798,14 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 		reqbuf->memory, req_count, dev->used_buffer_count,
 		dev->buffer_count);
 
-	switch (reqbuf->memory) {
-	case V4L2_MEMORY_MMAP:
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
-		reqbuf->capabilities = 0; /* only guarantee MMAP support */
+	reqbuf->capabilities = buffer_capabilities(opener, reqbuf->type);
 #endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
-		reqbuf->flags = 0; /* no memory consistency support */
+	reqbuf->flags = 0; /* no memory consistency support */
 #endif
-		break;
-	default:
+	if (!supports_memory(opener, reqbuf->type, reqbuf->memory))
 		return -EINVAL;
-	}
 
 	if (opener->format_token & ~token)
 		/* different (buffer) type already assigned to descriptor by
@@ -1658,6 +2820,7 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 	/* CASE queue/dequeue timeout-buffer only: */
 	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
 		opener->buffer_count = req_count;
+		opener->memory = reqbuf->memory;
 		if (req_count == 0)
 			release_token(dev, opener, format);
 		goto exit_reqbufs_unlock;
@@ -1671,6 +2834,10 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 			opener->io_method = V4L2L_IO_MMAP;
 		}
 		result = vidioc_streamoff(file, fh, reqbuf->type);
+		/* the buffers are gone for this opener, even if the stream
+		 * was not its to stop */
+		unpin_buffers(dev, opener);
+		free_buffer_meta(dev, opener);
 		opener->buffer_count = 0;
 		/* undocumented requirement - REQBUFS with count zero should
 		 * ALSO release lock on logical stream */
@@ -1686,6 +2853,10 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 	switch (reqbuf->type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+#endif
 		if (!(dev->format_tokens & token ||
 		      opener->format_token & token))
 			/* only exclusive ownership for each stream */
@@ -1722,6 +2893,11 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 		if (result < 0)
 			goto exit_reqbufs_unlock;
 	}
+	if (token == V4L2L_TOKEN_CAPTURE) {
+		result = alloc_buffer_meta(dev, opener);
+		if (result < 0)
+			goto exit_reqbufs_unlock;
+	}
 	acquire_token(dev, opener, format, token);
 
 	MARK();
@@ -1735,12 +2911,99 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 		prepare_buffer_queue(dev, req_count);
 		dev->used_buffer_count = opener->buffer_count = req_count;
 	}
+	opener->memory = reqbuf->memory;
+	memset(opener->user_buffers, 0, sizeof(opener->user_buffers));
+	bitmap_zero(opener->user_queued, MAX_BUFFERS);
+	opener->next_user_buffer = 0;
 exit_reqbufs_unlock:
 	mutex_unlock(&dev->image_mutex);
 	reqbuf->count = opener->buffer_count;
 	return result;
 }
 
+/* add buffers to the opener's buffer set
+ * the ring of inner buffers can only grow while the opener is its sole owner
+ * and not streaming; otherwise no buffers are added
+ * called on VIDIOC_CREATE_BUFS
+ */
+static int vidioc_create_bufs(struct file *file, void *fh,
+			      struct v4l2_create_buffers *cb)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	u32 type = cb->format.type;
+	u32 token = token_from_type(type);
+	u32 count;
+	int result = 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	cb->capabilities = buffer_capabilities(opener, type);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	cb->flags = 0; /* no memory consistency support */
+#endif
+	if (!is_video_type(type))
+		return -EINVAL;
+	if (!supports_memory(opener, type, cb->memory))
+		return -EINVAL;
+#ifdef HAVE_MPLANE
+	if (V4L2_TYPE_IS_MULTIPLANAR(type)) {
+		struct v4l2_pix_format pix;
+		pix_format_from_mplane(&cb->format.fmt.pix_mp, &pix);
+		if (dev->buffer_size && pix.sizeimage > dev->buffer_size)
+			return -EINVAL;
+	} else
+#endif
+		if (dev->buffer_size &&
+		    cb->format.fmt.pix.sizeimage > dev->buffer_size)
+		return -EINVAL;
+
+	/* without any buffers, this is just REQBUFS */
+	if (opener->buffer_count == 0) {
+		struct v4l2_requestbuffers reqbuf = {
+			.count = cb->count,
+			.type = type,
+			.memory = cb->memory,
+		};
+		if (cb->count == 0) {
+			cb->index = 0;
+			return 0;
+		}
+		result = vidioc_reqbufs(file, fh, &reqbuf);
+		cb->index = 0;
+		cb->count = result < 0 ? 0 : reqbuf.count;
+		return result;
+	}
+
+	if (cb->memory != opener->memory ||
+	    !(opener->format_token & token))
+		return -EINVAL;
+
+	result = mutex_lock_killable(&dev->image_mutex);
+	if (result < 0)
+		return result; /* -EINTR */
+
+	cb->index = opener->buffer_count;
+	count = cb->count;
+	cb->count = 0;
+	if (count == 0 || (opener->format_token & V4L2L_TOKEN_TIMEOUT) ||
+	    has_other_owners(opener, dev) || !(dev->stream_tokens & token))
+		goto exit_create_bufs_unlock;
+
+	count = min(count, dev->buffer_count - opener->buffer_count);
+	if (count == 0)
+		goto exit_create_bufs_unlock;
+	prepare_buffer_queue(dev, opener->buffer_count + count);
+	opener->buffer_count += count;
+	dev->used_buffer_count = opener->buffer_count;
+	cb->count = count;
+	dprintk("CREATE_BUFS(%u) -> %u buffers\n", count,
+		opener->buffer_count);
+exit_create_bufs_unlock:
+	mutex_unlock(&dev->image_mutex);
+	return result;
+}
+
 /* returns buffer asked for;
  * give app as many buffers as it wants, if it less than MAX,
  * but map them in our inner buffers
@@ -1750,20 +3013,22 @@ static int vidioc_querybuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2_plane *planes = buf->m.planes;
 	u32 type = buf->type;
 	u32 index = buf->index;
 
-	if ((type != V4L2_BUF_TYPE_VIDEO_CAPTURE) &&
-	    (type != V4L2_BUF_TYPE_VIDEO_OUTPUT))
+	if (!is_video_type(type))
 		return -EINVAL;
-	if (!is_allocated(opener, type, index))
+	if (!is_allocated(opener, type, index) || !has_planes(dev, buf))
 		return -EINVAL;
 
 	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
 		*buf = dev->timeout_buffer.buffer;
 		buf->index = index;
-	} else
+	} else {
 		*buf = dev->buffers[index].buffer;
+		set_buffer_memory(dev, opener, buf, type, planes);
+	}
 
 	buf->type = type;
 
@@ -1785,47 +3050,260 @@ static int vidioc_querybuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 	return 0;
 }
 
-static void buffer_written(struct v4l2_loopback_device *dev,
-			   struct v4l2l_buffer *buf)
+/* the status page entry of the frame at `position`: its sequence number,
+ * unless that is V4L2LOOPBACK_SEQUENCE_INVALID, which would read as intact
+ * even while the buffer is rewritten; that (one in 2^32) frame gets an entry
+ * that never matches, so consumers reading it in place discard it */
+static u32 frame_status(s64 position)
 {
-	del_timer_sync(&dev->sustain_timer);
-	del_timer_sync(&dev->timeout_timer);
+	u32 sequence = (u32)position;
 
-	spin_lock_bh(&dev->list_lock);
-	list_move_tail(&buf->list_head, &dev->outbufs_list);
-	spin_unlock_bh(&dev->list_lock);
+	if (sequence == V4L2LOOPBACK_SEQUENCE_INVALID)
+		return V4L2LOOPBACK_SEQUENCE_INVALID - 1;
+	return sequence;
+}
 
+static void buffer_written(struct v4l2_loopback_device *dev,
+			   struct v4l2l_buffer *buf)
+{
 	spin_lock_bh(&dev->lock);
+	list_move_tail(&buf->list_head, &dev->outbufs_list);
+	buf->filling = false;
+	write_seqcount_begin(&dev->head_seq);
+	buf->position = dev->write_position;
+	/* (the write barrier in write_seqcount_begin() orders this after the
+	 * frame data) */
+	WRITE_ONCE(dev->status[buf->buffer.index],
+		   frame_status(dev->write_position));
+	buf->written = ktime_get();
+	dev->publish_time = buf->written;
 	dev->bufpos2index[v4l2l_mod64(dev->write_position,
 				      dev->used_buffer_count)] =
 		buf->buffer.index;
+	if (buf->buffer.flags & V4L2_BUF_FLAG_KEYFRAME)
+		dev->keyframe_position = dev->write_position;
 	++dev->write_position;
 	dev->reread_count = 0;
+	write_seqcount_end(&dev->head_seq);
 
+	/* the timers are not cancelled: they check `last_write` when they
+	 * fire and push their deadline forward if a frame came in */
+	dev->last_write = buf->written;
 	check_timers(dev);
 	spin_unlock_bh(&dev->lock);
 }
 
-/* put buffer to queue
- * called on VIDIOC_QBUF
- */
-static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
+/* the buffer the producer gets next: the oldest one that is not pinned by a
+ * consumer, or NULL if there is none; call with `lock` held */
+static struct v4l2l_buffer *next_output_buffer(struct v4l2_loopback_device *dev)
 {
-	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
-	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
 	struct v4l2l_buffer *bufd;
-	u32 index = buf->index;
+
+	list_for_each_entry(bufd, &dev->outbufs_list, list_head) {
+		if (!bufd->pin_count)
+			return bufd;
+	}
+	return NULL;
+}
+
+/* whether the frame at `position` may be overwritten: always, unless in
+ * lossless mode a streaming consumer has not read it yet; consumers with a
+ * reduced frame rate skip frames anyway (and only wake up on their own
+ * ticks), so they do not hold the producer back; call with `lock` held */
+static bool frame_released(struct v4l2_loopback_device *dev, s64 position)
+{
+	struct v4l2_loopback_opener *opener;
+
+	if (!dev->lossless || position < 0)
+		return true;
+
+	list_for_each_entry(opener, &dev->openers, node) {
+		if ((opener->stream_token & V4L2L_TOKEN_CAPTURE) &&
+		    !decimating(dev, opener) &&
+		    READ_ONCE(opener->read_position) <= position)
+			return false;
+	}
+	return true;
+}
+
+/* whether the producer can get a buffer without waiting */
+static bool output_buffer_ready(struct v4l2_loopback_device *dev)
+{
+	struct v4l2l_buffer *bufd;
+	bool ready;
+
+	spin_lock_bh(&dev->lock);
+	if (list_empty(&dev->outbufs_list)) {
+		ready = true;
+	} else {
+		bufd = next_output_buffer(dev);
+		ready = bufd && frame_released(dev, bufd->position);
+	}
+	spin_unlock_bh(&dev->lock);
+	return ready;
+}
+
+/* mark the buffer as being rewritten, until buffer_written(); consumers
+ * reading it in place can tell from the status page; call with `lock` held */
+static void start_filling(struct v4l2_loopback_device *dev,
+			  struct v4l2l_buffer *bufd)
+{
+	if (bufd->filling)
+		return;
+	bufd->filling = true;
+	WRITE_ONCE(dev->status[bufd->buffer.index],
+		   V4L2LOOPBACK_SEQUENCE_INVALID);
+	/* before any of the new data */
+	smp_wmb();
+}
+
+/* hand a buffer to the producer for filling, if it can get one without
+ * waiting (the same check as output_buffer_ready(), but in one go with taking
+ * it, so that no consumer can pin or seek back to it in between); -EAGAIN if
+ * it cannot */
+static int take_output_buffer(struct v4l2_loopback_device *dev,
+			      struct v4l2l_buffer **bufd)
+{
+	int result = 0;
+
+	spin_lock_bh(&dev->lock);
+	*bufd = next_output_buffer(dev);
+	if (list_empty(&dev->outbufs_list))
+		result = -EFAULT;
+	else if (!*bufd || !frame_released(dev, (*bufd)->position))
+		result = -EAGAIN;
+	if (!result) {
+		list_move_tail(&(*bufd)->list_head, &dev->outbufs_list);
+		start_filling(dev, *bufd);
+	}
+	spin_unlock_bh(&dev->lock);
+	return result;
+}
+
+/* get a buffer for the producer to fill, waiting until there is one that is
+ * not pinned (and, in lossless mode, whose frame has been read) */
+static int wait_output_buffer(struct file *file, struct v4l2l_buffer **bufd)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	int result;
+
+	for (;;) {
+		result = take_output_buffer(dev, bufd);
+		if (result != -EAGAIN || (file->f_flags & O_NONBLOCK))
+			return result;
+		result = wait_event_interruptible(dev->write_event,
+						  output_buffer_ready(dev));
+		if (result < 0)
+			return result;
+	}
+}
+
+/* keep the producer from getting the buffer `index` back until the opener
+ * queues it again; fails if the buffer no longer holds the frame at
+ * `position` (or any frame, if `position < 0`) or is being refilled */
+static bool pin_buffer(struct v4l2_loopback_device *dev,
+		       struct v4l2_loopback_opener *opener, u32 index,
+		       s64 position)
+{
+	struct v4l2l_buffer *bufd = &dev->buffers[index];
+	bool pinned = false;
+
+	spin_lock_bh(&dev->lock);
+	if (!bufd->filling && (position < 0 || bufd->position == position)) {
+		if (!test_and_set_bit(index, opener->pinned))
+			++bufd->pin_count;
+		pinned = true;
+	}
+	spin_unlock_bh(&dev->lock);
+	return pinned;
+}
+
+static void unpin_buffer(struct v4l2_loopback_device *dev,
+			 struct v4l2_loopback_opener *opener, u32 index)
+{
+	spin_lock_bh(&dev->lock);
+	if (test_and_clear_bit(index, opener->pinned))
+		--dev->buffers[index].pin_count;
+	spin_unlock_bh(&dev->lock);
+	wake_up_all(&dev->write_event);
+}
+
+/* drop all pins of the opener */
+static void unpin_buffers(struct v4l2_loopback_device *dev,
+			  struct v4l2_loopback_opener *opener)
+{
+	unsigned int index;
+
+	spin_lock_bh(&dev->lock);
+	for_each_set_bit(index, opener->pinned, MAX_BUFFERS)
+		--dev->buffers[index].pin_count;
+	bitmap_zero(opener->pinned, MAX_BUFFERS);
+	spin_unlock_bh(&dev->lock);
+	wake_up_all(&dev->write_event);
+}
+
+/* carry the producer's per-frame metadata (that is not about the buffer
+ * itself) through the ring to the consumers */
+static void copy_frame_info(struct v4l2_loopback_device *dev,
+			    struct v4l2_buffer *dst,
+			    const struct v4l2_buffer *src)
+{
+	dst->flags &= ~V4L2L_FRAME_FLAGS;
+	dst->flags |= src->flags & V4L2L_FRAME_FLAGS;
+	if (src->flags & V4L2_BUF_FLAG_TIMECODE)
+		dst->timecode = src->timecode;
+	else
+		memset(&dst->timecode, 0, sizeof(dst->timecode));
+	/* (`src->field` has been checked in vidioc_qbuf()) */
+	if (src->field == V4L2_FIELD_ANY)
+		dst->field = dev->pix_format.field;
+	else
+		dst->field = src->field;
+}
+
+/* hand the damage reported by the producer over to the frame it queues; it
+ * has to report it anew for the next one */
+static void attach_damage(struct v4l2_loopback_device *dev,
+			  struct v4l2_loopback_opener *opener,
+			  struct v4l2l_buffer *bufd)
+{
+	spin_lock_bh(&dev->lock);
+	bufd->damage_count = opener->damage_count;
+	if (opener->damage_count > 0)
+		memcpy(bufd->damage, opener->damage,
+		       opener->damage_count * sizeof(*bufd->damage));
+	opener->damage_count = -1;
+	spin_unlock_bh(&dev->lock);
+}
+
+/* put buffer to queue
+ * called on VIDIOC_QBUF
+ */
+static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2_plane *planes = buf->m.planes;
+	struct v4l2l_buffer *bufd;
+	u32 index = buf->index;
 	u32 type = buf->type;
 
-	if (!is_allocated(opener, type, index))
+	if (!is_allocated(opener, type, index) || !has_planes(dev, buf))
 		return -EINVAL;
 	bufd = &dev->buffers[index];
 
+	if (buf->memory != opener->memory)
+		return -EINVAL;
 	switch (buf->memory) {
 	case V4L2_MEMORY_MMAP:
 		if (!(bufd->buffer.flags & V4L2_BUF_FLAG_MAPPED))
 			dprintkrw("QBUF() unmapped buffer [index=%u]\n", index);
 		break;
+	case V4L2_MEMORY_USERPTR:
+#ifdef HAVE_DMABUF
+	case V4L2_MEMORY_DMABUF:
+#endif
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -1837,13 +3315,39 @@ static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 
 	switch (type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+#endif
 		dprintkrw("QBUF(CAPTURE, index=%u) -> " BUFFER_DEBUG_FMT_STR,
 			  index, BUFFER_DEBUG_FMT_ARGS(buf));
+		if (test_bit(index, opener->pinned))
+			unpin_buffer(dev, opener, index);
+		if (buf->memory == V4L2_MEMORY_USERPTR) {
+			int result = queue_userptr(dev, opener, buf);
+			if (result < 0)
+				return result;
+		}
 		set_queued(buf->flags);
 		break;
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+#endif
 		dprintkrw("QBUF(OUTPUT, index=%u) -> " BUFFER_DEBUG_FMT_STR,
 			  index, BUFFER_DEBUG_FMT_ARGS(buf));
+		/* the field is passed on to the consumers as is */
+		if (buf->field > V4L2_FIELD_INTERLACED_BT)
+			return -EINVAL;
+		/* (in case the producer did not dequeue it first) */
+		spin_lock_bh(&dev->lock);
+		start_filling(dev, bufd);
+		spin_unlock_bh(&dev->lock);
+		if (buf->memory != V4L2_MEMORY_MMAP ||
+		    V4L2_TYPE_IS_MULTIPLANAR(type)) {
+			int result = import_buffer(dev, opener, bufd, buf);
+			if (result < 0)
+				return result;
+		}
 		if (!(bufd->buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_COPY) &&
 		    (buf->timestamp.tv_sec == 0 &&
 		     buf->timestamp.tv_usec == 0)) {
@@ -1873,12 +3377,16 @@ static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 		} else {
 			bufd->buffer.bytesused = buf->bytesused;
 		}
+		copy_frame_info(dev, &bufd->buffer, buf);
+		memcpy(bufd->meta, opener->meta, sizeof(bufd->meta));
+		attach_damage(dev, opener, bufd);
 		bufd->buffer.sequence = dev->write_position;
 		set_queued(bufd->buffer.flags);
 		*buf = bufd->buffer;
+		set_buffer_memory(dev, opener, buf, type, planes);
 		buffer_written(dev, bufd);
 		set_done(bufd->buffer.flags);
-		wake_up_all(&dev->read_event);
+		wake_up_readers(dev);
 		break;
 	default:
 		return -EINVAL;
@@ -1887,56 +3395,323 @@ static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 	return 0;
 }
 
+/* snapshot of the ring head, as published by the writer through `head_seq` */
+struct v4l2l_ring_head {
+	s64 write_position;
+	ktime_t publish_time;
+	unsigned int reread_count;
+	unsigned int timeout_count;
+};
+
+static void read_ring_head(struct v4l2_loopback_device *dev,
+			   struct v4l2l_ring_head *head)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&dev->head_seq);
+		head->write_position = dev->write_position;
+		head->publish_time = dev->publish_time;
+		head->reread_count = dev->reread_count;
+		head->timeout_count = dev->timeout_count;
+	} while (read_seqcount_retry(&dev->head_seq, seq));
+}
+
+/* lockless check whether a new frame is available for this opener;
+ * the timers are armed by the writer, not here */
 static int can_read(struct v4l2_loopback_device *dev,
 		    struct v4l2_loopback_opener *opener)
 {
-	int ret;
+	struct v4l2l_ring_head head;
+
+	read_ring_head(dev, &head);
+	if (head.timeout_count != opener->timeout_count)
+		return 1;
+	if (head.write_position <= opener->read_position &&
+	    head.reread_count <= opener->reread_count)
+		return 0;
+	/* a decimating opener only wants the frame nearest to its tick */
+	return !decimating(dev, opener) ||
+	       !ktime_before(ktime_add_ns(head.publish_time, dev->frame_ns / 2),
+			     opener->next_tick);
+}
+
+/* make the opener read the frame `value` frames before the next new one
+ * (`relative`), or the one with the sequence number `value`, next; fails if
+ * that frame is not in the ring (anymore, or yet) */
+static int seek_capture(struct v4l2_loopback_device *dev,
+			struct v4l2_loopback_opener *opener, s64 value,
+			bool relative)
+{
+	struct v4l2l_ring_head head;
+	s64 ago;
+
+	read_ring_head(dev, &head);
+	if (relative)
+		ago = value;
+	else
+		ago = (u32)((u32)head.write_position - (u32)value);
+	/* (the oldest frame is likely being overwritten already) */
+	if (ago > min_t(s64, head.write_position, dev->used_buffer_count - 1))
+		return -ERANGE;
+
+	spin_lock(&opener->read_lock);
+	WRITE_ONCE(opener->read_position, head.write_position - ago);
+	/* no rereads until a new frame */
+	opener->reread_count = head.reread_count;
+	spin_unlock(&opener->read_lock);
+	if (ago)
+		wake_up_all(&opener->read_event);
+	return 0;
+}
+
+/* the union of the damage of all frames after the one the opener read
+ * before, up to the one at `position`; everything if any of them is not in
+ * the ring anymore; call with `lock` held */
+static void collect_damage(struct v4l2_loopback_device *dev,
+			   struct v4l2_loopback_opener *opener, s64 position)
+{
+	struct v4l2l_buffer *bufd;
+	s64 pos = opener->damage_position;
+	int i;
+
+	opener->damage_position = position;
+	opener->damage_count = 0;
+	if (pos < 0 || position < pos ||
+	    position - pos > dev->used_buffer_count)
+		goto full;
+	while (++pos <= position) {
+		bufd = &dev->buffers[dev->bufpos2index[v4l2l_mod64(
+			pos, dev->used_buffer_count)]];
+		if (bufd->filling || bufd->position != pos ||
+		    bufd->damage_count < 0)
+			goto full;
+		for (i = 0; i < bufd->damage_count; ++i)
+			add_damage(opener->damage, &opener->damage_count,
+				   &bufd->damage[i]);
+	}
+	return;
+full:
+	set_full_damage(dev, opener->damage, &opener->damage_count);
+}
+
+/* whether buffer `index` (still) holds the frame at `position`, and that
+ * frame is a keyframe */
+static bool holds_keyframe(struct v4l2_loopback_device *dev, u32 index,
+			   s64 position)
+{
+	struct v4l2l_buffer *bufd = &dev->buffers[index];
+	bool keyframe;
 
 	spin_lock_bh(&dev->lock);
-	check_timers(dev);
-	ret = dev->write_position > opener->read_position ||
-	      dev->reread_count > opener->reread_count || dev->timeout_happened;
+	keyframe = !bufd->filling && bufd->position == position &&
+		   (bufd->buffer.flags & V4L2_BUF_FLAG_KEYFRAME);
 	spin_unlock_bh(&dev->lock);
-	return ret;
+	return keyframe;
+}
+
+/* keep the metadata and damage of the frame at `position` for the opener,
+ * unless the buffer has been refilled meanwhile (or `position < 0`, for the
+ * timeout image), so it can get them after dequeuing the frame */
+static void fetch_frame_info(struct v4l2_loopback_device *dev,
+			     struct v4l2_loopback_opener *opener, u32 index,
+			     s64 position)
+{
+	struct v4l2l_buffer *bufd = &dev->buffers[index];
+
+	spin_lock_bh(&dev->lock);
+	if (position >= 0 && !bufd->filling && bufd->position == position)
+		memcpy(opener->read_meta, bufd->meta, sizeof(bufd->meta));
+	else
+		memset(opener->read_meta, 0, sizeof(opener->read_meta));
+	collect_damage(dev, opener, position);
+	spin_unlock_bh(&dev->lock);
+}
+
+/* file the metadata of the frame read last under the index of the buffer it
+ * was dequeued into (which for USERPTR buffers is not the inner buffer's), so
+ * the opener can still get it after dequeuing further frames */
+static void keep_frame_meta(struct v4l2_loopback_device *dev,
+			    struct v4l2_loopback_opener *opener, u32 index)
+{
+	spin_lock_bh(&dev->lock);
+	if (opener->buffer_meta) {
+		memcpy(opener->buffer_meta[index], opener->read_meta,
+		       sizeof(opener->read_meta));
+		opener->meta_buffer = index;
+	}
+	spin_unlock_bh(&dev->lock);
+}
+
+/* the per-buffer metadata is only needed by consumers, so it is allocated
+ * when they acquire their buffers, rather than on every open() */
+static int alloc_buffer_meta(struct v4l2_loopback_device *dev,
+			     struct v4l2_loopback_opener *opener)
+{
+#ifdef HAVE_FRAME_METADATA
+	u8 (*buffer_meta)[V4L2LOOPBACK_META_SIZE];
+
+	if (opener->buffer_meta)
+		return 0;
+	buffer_meta = vzalloc(MAX_BUFFERS * sizeof(*buffer_meta));
+	if (!buffer_meta)
+		return -ENOMEM;
+	spin_lock_bh(&dev->lock);
+	opener->buffer_meta = buffer_meta;
+	spin_unlock_bh(&dev->lock);
+#endif
+	return 0;
+}
+
+static void free_buffer_meta(struct v4l2_loopback_device *dev,
+			     struct v4l2_loopback_opener *opener)
+{
+	u8 (*buffer_meta)[V4L2LOOPBACK_META_SIZE];
+
+	spin_lock_bh(&dev->lock);
+	buffer_meta = opener->buffer_meta;
+	opener->buffer_meta = NULL;
+	opener->meta_buffer = -1;
+	spin_unlock_bh(&dev->lock);
+	vfree(buffer_meta);
+}
+
+/* wake up the openers that are waiting for a frame and can read one now,
+ * rather than everybody who has the device open */
+static void wake_up_readers(struct v4l2_loopback_device *dev)
+{
+	struct v4l2_loopback_opener *opener;
+
+	spin_lock_bh(&dev->lock);
+	list_for_each_entry(opener, &dev->openers, node) {
+		if (!(opener->format_token & V4L2L_TOKEN_CAPTURE) ||
+		    !wq_has_sleeper(&opener->read_event))
+			continue;
+		if (can_read(dev, opener))
+			wake_up(&opener->read_event);
+	}
+	spin_unlock_bh(&dev->lock);
+}
+
+/* how long ago the frame at `position` was written, in nsecs; call within a
+ * `head_seq` read section
+ * this is measured from when the frame was queued, not from its timestamp:
+ * with V4L2_BUF_FLAG_TIMESTAMP_COPY that is the producer's, on a clock of its
+ * own choosing (and otherwise it is taken at the same time anyway) */
+static s64 frame_age(struct v4l2_loopback_device *dev, s64 position,
+		     ktime_t now)
+{
+	u32 index = dev->bufpos2index[v4l2l_mod64(position,
+						  dev->used_buffer_count)];
+	return ktime_to_ns(ktime_sub(now, dev->buffers[index].written));
 }
 
 static int get_capture_buffer(struct file *file)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
+	struct v4l2l_ring_head head;
+	s64 read_position;
+	s64 max_age = (s64)opener->max_frame_age * NSEC_PER_USEC;
+	ktime_t now = 0;
+	unsigned int reread_count, seq;
 	int pos, timeout_happened;
+	s64 frame;
 	u32 index;
+	u8 *addr;
 
-	if ((file->f_flags & O_NONBLOCK) &&
-	    (dev->write_position <= opener->read_position &&
-	     dev->reread_count <= opener->reread_count &&
-	     !dev->timeout_happened))
+again:
+	if ((file->f_flags & O_NONBLOCK) && !can_read(dev, opener))
 		return -EAGAIN;
-	wait_event_interruptible(dev->read_event, can_read(dev, opener));
+	wait_event_interruptible(opener->read_event, can_read(dev, opener));
+	if (max_age)
+		now = ktime_get();
+
+	/* the ring head needs to be consistent: pick the slot from a snapshot
+	 * and retry if a writer moved the head meanwhile; the opener's own
+	 * state only changes under `read_lock` */
+	spin_lock(&opener->read_lock);
+	do {
+		seq = read_seqcount_begin(&dev->head_seq);
+		head.write_position = dev->write_position;
+		head.publish_time = dev->publish_time;
+		head.reread_count = dev->reread_count;
+		head.timeout_count = dev->timeout_count;
+		read_position = opener->read_position;
+		reread_count = opener->reread_count;
+		if (head.write_position == read_position) {
+			if (head.reread_count > reread_count + 2)
+				reread_count = head.reread_count - 1;
+			++reread_count;
+			frame = read_position - 1;
+			pos = v4l2l_mod64(read_position +
+						  dev->used_buffer_count - 1,
+					  dev->used_buffer_count);
+		} else {
+			reread_count = 0;
+			/* skip to the newest frame if the older ones were
+			 * overwritten, or if the opener only wants that one */
+			if (head.write_position >
+				    read_position + dev->used_buffer_count ||
+			    opener->latest_frame || decimating(dev, opener))
+				read_position = head.write_position - 1;
+			/* skip frames that are older than the opener accepts,
+			 * but never the newest one */
+			while (max_age &&
+			       read_position < head.write_position - 1 &&
+			       frame_age(dev, read_position, now) > max_age)
+				++read_position;
+			frame = read_position;
+			pos = v4l2l_mod64(read_position,
+					  dev->used_buffer_count);
+			++read_position;
+		}
+		index = dev->bufpos2index[pos];
+	} while (read_seqcount_retry(&dev->head_seq, seq));
+
+	WRITE_ONCE(opener->read_position, read_position);
+	opener->reread_count = reread_count;
+	spin_unlock(&opener->read_lock);
+	if (decimating(dev, opener)) {
+		ktime_t tick = ktime_add_ns(opener->next_tick, opener->frame_ns);
+		/* do not try to catch up with missed ticks */
+		if (ktime_before(tick, head.publish_time))
+			tick = ktime_add_ns(head.publish_time, opener->frame_ns);
+		opener->next_tick = tick;
+	}
+	if (dev->lossless && wq_has_sleeper(&dev->write_event))
+		wake_up(&dev->write_event);
+	timeout_happened = head.timeout_count != opener->timeout_count &&
+			   dev->timeout_ns > 0;
+	opener->timeout_count = head.timeout_count;
+
+	/* frames before the first keyframe cannot be decoded */
+	if (opener->wait_keyframe && !timeout_happened) {
+		if (!holds_keyframe(dev, index, frame)) {
+			dprintkrw("get_capture_buffer() skipping frame %lld, "
+				  "waiting for a keyframe\n",
+				  (long long)frame);
+			goto again;
+		}
+		opener->wait_keyframe = false;
+	}
 
-	spin_lock_bh(&dev->lock);
-	if (dev->write_position == opener->read_position) {
-		if (dev->reread_count > opener->reread_count + 2)
-			opener->reread_count = dev->reread_count - 1;
-		++opener->reread_count;
-		pos = v4l2l_mod64(opener->read_position +
-					  dev->used_buffer_count - 1,
-				  dev->used_buffer_count);
-	} else {
-		opener->reread_count = 0;
-		if (dev->write_position >
-		    opener->read_position + dev->used_buffer_count)
-			opener->read_position = dev->write_position - 1;
-		pos = v4l2l_mod64(opener->read_position,
-				  dev->used_buffer_count);
-		++opener->read_position;
-	}
-	timeout_happened = dev->timeout_happened && (dev->timeout_jiffies > 0);
-	dev->timeout_happened = 0;
-	spin_unlock_bh(&dev->lock);
+	/* hold on to the buffer until it is queued again; the timeout image
+	 * replaces whatever frame it holds, so any will do then */
+	if (opener->pin_buffers && opener->memory == V4L2_MEMORY_MMAP &&
+	    opener->io_method == V4L2L_IO_MMAP &&
+	    !pin_buffer(dev, opener, index, timeout_happened ? -1 : frame)) {
+		dprintkrw("get_capture_buffer() frame %lld was overwritten "
+			  "before it could be pinned\n",
+			  (long long)frame);
+		goto again;
+	}
+	fetch_frame_info(dev, opener, index, timeout_happened ? -1 : frame);
 
-	index = dev->bufpos2index[pos];
 	if (timeout_happened) {
+		struct v4l2l_buffer *bufd = &dev->buffers[index];
+		bool busy;
+
 		if (index >= dev->used_buffer_count) {
 			dprintkrw("get_capture_buffer() read position is at "
 				  "an unallocated buffer [index=%u]\n",
@@ -1946,70 +3721,450 @@ static int get_capture_buffer(struct file *file)
 		/* although allocated on-demand, timeout_image is freed only
 		 * in free_buffers(), so we don't need to worry about it being
 		 * deallocated suddenly */
-		memcpy(dev->image + dev->buffers[index].buffer.m.offset,
-		       dev->timeout_image, dev->buffer_size);
+		addr = get_buffer_data(dev, bufd);
+		if (!addr)
+			return -ENOMEM;
+		/* leave the frame alone if another consumer has it pinned or
+		 * the producer is refilling it; otherwise keep both away
+		 * while the timeout image replaces it */
+		spin_lock_bh(&dev->lock);
+		busy = bufd->filling ||
+		       bufd->pin_count > test_bit(index, opener->pinned);
+		if (!busy) {
+			start_filling(dev, bufd);
+			bufd->position = -1;
+		}
+		spin_unlock_bh(&dev->lock);
+		if (busy) {
+			dprintkrw("get_capture_buffer() buffer#%u is in use, "
+				  "not replacing it with the timeout image\n",
+				  index);
+			return (int)index;
+		}
+		memcpy(addr, dev->timeout_image, dev->buffer_size);
+		spin_lock_bh(&dev->lock);
+		bufd->filling = false;
+		spin_unlock_bh(&dev->lock);
+	}
+	return (int)index;
+}
+
+/* validate a buffer before queueing it
+ * all copying happens on QBUF/DQBUF, so there is nothing to prepare ahead
+ * called on VIDIOC_PREPARE_BUF
+ */
+static int vidioc_prepare_buf(struct file *file, void *fh,
+			      struct v4l2_buffer *buf)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2l_planes layout;
+	struct v4l2_plane single, *planes;
+	u32 index = buf->index;
+	u32 type = buf->type;
+	u32 memory = buf->memory;
+	u32 i;
+
+	if (!is_allocated(opener, type, index) || !has_planes(dev, buf))
+		return -EINVAL;
+	if (memory != opener->memory)
+		return -EINVAL;
+	get_planes(dev, type, &layout);
+	planes = get_user_planes(buf, &layout, &single);
+	for (i = 0; i < layout.count; ++i) {
+		switch (memory) {
+		case V4L2_MEMORY_USERPTR:
+			if (!planes[i].m.userptr || !planes[i].length)
+				return -EINVAL;
+			break;
+#ifdef HAVE_DMABUF
+		case V4L2_MEMORY_DMABUF:
+			if (planes[i].m.fd < 0)
+				return -EINVAL;
+			break;
+#endif
+		default:
+			break;
+		}
+	}
+
+	buf->flags |= V4L2_BUF_FLAG_PREPARED;
+	dprintkrw("PREPARE_BUF(%s, index=%u)\n",
+		  V4L2_TYPE_IS_CAPTURE(type) ? "CAPTURE" : "OUTPUT", index);
+	return 0;
+}
+
+/* put buffer to dequeue
+ * called on VIDIOC_DQBUF
+ */
+static int vidioc_dqbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2_plane *planes = buf->m.planes;
+	u32 type = buf->type;
+	int index, result;
+	struct v4l2l_buffer *bufd;
+
+	if (buf->memory != opener->memory || !has_planes(dev, buf))
+		return -EINVAL;
+	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
+		*buf = dev->timeout_buffer.buffer;
+		buf->type = type;
+		unset_flags(buf->flags);
+		return 0;
+	}
+	if ((opener->buffer_count == 0) ||
+	    !(opener->format_token & token_from_type(type)))
+		return -EINVAL;
+
+	switch (type) {
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+#endif
+		if (opener->memory == V4L2_MEMORY_USERPTR &&
+		    bitmap_empty(opener->user_queued, MAX_BUFFERS))
+			return -EINVAL;
+		index = get_capture_buffer(file);
+		if (index < 0)
+			return index;
+		if (opener->memory == V4L2_MEMORY_USERPTR) {
+			int result = export_userptr(dev, opener, index, buf);
+			if (result < 0)
+				return result;
+		} else {
+			*buf = dev->buffers[index].buffer;
+			set_buffer_memory(dev, opener, buf, type, planes);
+		}
+		keep_frame_meta(dev, opener, buf->index);
+		unset_flags(buf->flags);
+		break;
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+#endif
+		result = wait_output_buffer(file, &bufd);
+		if (result < 0)
+			return result;
+		unset_flags(bufd->buffer.flags);
+		*buf = bufd->buffer;
+		set_buffer_memory(dev, opener, buf, type, planes);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	buf->type = type;
+	dprintkrw("DQBUF(%s, index=%u) -> " BUFFER_DEBUG_FMT_STR,
+		  V4L2_TYPE_IS_CAPTURE(type) ? "CAPTURE" : "OUTPUT", index,
+		  BUFFER_DEBUG_FMT_ARGS(buf));
+	return 0;
+}
+
+/* ------------- DMA-BUF ------------------- */
+
+#ifdef HAVE_DMABUF
+/* a dma-buf exported from one of the inner buffers
+ * the pages are referenced for the lifetime of the dma-buf, so it stays valid
+ * even if the buffers are re-allocated (e.g. after a format change) */
+struct v4l2l_dmabuf {
+	struct page **pages;
+	unsigned int page_count;
+};
+
+static int v4l2l_dmabuf_attach(struct dma_buf *dbuf,
+			       struct dma_buf_attachment *attach)
+{
+	struct v4l2l_dmabuf *buf = dbuf->priv;
+	struct sg_table *sgt;
+	int result;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return -ENOMEM;
+	result = sg_alloc_table_from_pages(sgt, buf->pages, buf->page_count, 0,
+					   (unsigned long)buf->page_count
+						   << PAGE_SHIFT,
+					   GFP_KERNEL);
+	if (result < 0) {
+		kfree(sgt);
+		return result;
+	}
+	attach->priv = sgt;
+	return 0;
+}
+
+static void v4l2l_dmabuf_detach(struct dma_buf *dbuf,
+				struct dma_buf_attachment *attach)
+{
+	struct sg_table *sgt = attach->priv;
+
+	sg_free_table(sgt);
+	kfree(sgt);
+	attach->priv = NULL;
+}
+
+static struct sg_table *v4l2l_dmabuf_map(struct dma_buf_attachment *attach,
+					 enum dma_data_direction dir)
+{
+	struct sg_table *sgt = attach->priv;
+
+	if (dma_map_sgtable(attach->dev, sgt, dir, 0))
+		return ERR_PTR(-EIO);
+	return sgt;
+}
+
+static void v4l2l_dmabuf_unmap(struct dma_buf_attachment *attach,
+			       struct sg_table *sgt,
+			       enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+}
+
+static void v4l2l_dmabuf_free(struct v4l2l_dmabuf *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < buf->page_count; ++i)
+		put_page(buf->pages[i]);
+	kfree(buf->pages);
+	kfree(buf);
+}
+
+static void v4l2l_dmabuf_release(struct dma_buf *dbuf)
+{
+	v4l2l_dmabuf_free(dbuf->priv);
+}
+
+static int v4l2l_dmabuf_mmap(struct dma_buf *dbuf, struct vm_area_struct *vma)
+{
+	struct v4l2l_dmabuf *buf = dbuf->priv;
+
+	return vm_map_pages(vma, buf->pages, buf->page_count);
+}
+
+#ifdef v4l2l_vmap_t
+static int v4l2l_dmabuf_vmap(struct dma_buf *dbuf, v4l2l_vmap_t *map)
+{
+	struct v4l2l_dmabuf *buf = dbuf->priv;
+	void *vaddr = vmap(buf->pages, buf->page_count, VM_MAP, PAGE_KERNEL);
+
+	if (!vaddr)
+		return -ENOMEM;
+	v4l2l_vmap_set_vaddr(map, vaddr);
+	return 0;
+}
+
+static void v4l2l_dmabuf_vunmap(struct dma_buf *dbuf, v4l2l_vmap_t *map)
+{
+	vunmap(map->vaddr);
+}
+#else
+static void *v4l2l_dmabuf_vmap(struct dma_buf *dbuf)
+{
+	struct v4l2l_dmabuf *buf = dbuf->priv;
+
+	return vmap(buf->pages, buf->page_count, VM_MAP, PAGE_KERNEL);
+}
+
+static void v4l2l_dmabuf_vunmap(struct dma_buf *dbuf, void *vaddr)
+{
+	vunmap(vaddr);
+}
+#endif /* v4l2l_vmap_t */
+
+static const struct dma_buf_ops v4l2l_dmabuf_ops = {
+	// clang-format off
+	.attach		= v4l2l_dmabuf_attach,
+	.detach		= v4l2l_dmabuf_detach,
+	.map_dma_buf	= v4l2l_dmabuf_map,
+	.unmap_dma_buf	= v4l2l_dmabuf_unmap,
+	.release	= v4l2l_dmabuf_release,
+	.mmap		= v4l2l_dmabuf_mmap,
+	.vmap		= v4l2l_dmabuf_vmap,
+	.vunmap		= v4l2l_dmabuf_vunmap,
+	// clang-format on
+};
+
+/* wraps the pages of (a plane of) an inner buffer into a new dma-buf
+ * must be called with `image_mutex` held */
+static struct dma_buf *v4l2l_dmabuf_export(u8 *addr, u32 size, int flags)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct v4l2l_dmabuf *buf;
+	struct dma_buf *dbuf;
+	unsigned int i;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+	buf->page_count = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	buf->pages = kcalloc(buf->page_count, sizeof(*buf->pages), GFP_KERNEL);
+	if (!buf->pages) {
+		kfree(buf);
+		return ERR_PTR(-ENOMEM);
+	}
+	for (i = 0; i < buf->page_count; ++i) {
+		buf->pages[i] = vmalloc_to_page(addr + (i << PAGE_SHIFT));
+		get_page(buf->pages[i]);
+	}
+
+	exp_info.ops = &v4l2l_dmabuf_ops;
+	exp_info.size = (size_t)buf->page_count << PAGE_SHIFT;
+	exp_info.flags = flags;
+	exp_info.priv = buf;
+	dbuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dbuf))
+		v4l2l_dmabuf_free(buf);
+	return dbuf;
+}
+
+/* copy the contents of the dma-buf `buf->m.fd`, starting at `offset`, to
+ * `addr` (at most `size` bytes); if `buf->bytesused` is 0, the entire dma-buf
+ * is used
+ * this is a copy: no reference to the dma-buf is kept, as consumers map the
+ * ring's own pages */
+static int import_dmabuf(u8 *addr, u32 size, struct v4l2_buffer *buf,
+			 u32 offset)
+{
+	struct dma_buf *dbuf;
+	size_t count;
+	int result;
+#ifdef v4l2l_vmap_t
+	v4l2l_vmap_t map;
+#else
+	void *vaddr;
+#endif
+
+	dbuf = dma_buf_get(buf->m.fd);
+	if (IS_ERR(dbuf))
+		return PTR_ERR(dbuf);
+
+	count = buf->bytesused ? buf->bytesused : dbuf->size;
+	if (count > dbuf->size || offset > count || dbuf->size > INT_MAX) {
+		result = -EINVAL;
+		goto exit_import_put;
 	}
-	return (int)index;
+	count -= offset;
+	if (count > size)
+		count = size;
+
+	result = dma_buf_begin_cpu_access(dbuf, DMA_FROM_DEVICE);
+	if (result < 0)
+		goto exit_import_put;
+#ifdef v4l2l_vmap_t
+	result = v4l2l_dma_buf_vmap(dbuf, &map);
+	if (result < 0)
+		goto exit_import_end;
+	if (map.is_iomem)
+		memcpy_fromio(addr, map.vaddr_iomem + offset, count);
+	else
+		memcpy(addr, map.vaddr + offset, count);
+	v4l2l_dma_buf_vunmap(dbuf, &map);
+#else
+	vaddr = dma_buf_vmap(dbuf);
+	if (!vaddr) {
+		result = -ENOMEM;
+		goto exit_import_end;
+	}
+	memcpy(addr, vaddr + offset, count);
+	dma_buf_vunmap(dbuf, vaddr);
+#endif
+	buf->bytesused = count;
+	buf->length = dbuf->size;
+exit_import_end:
+	dma_buf_end_cpu_access(dbuf, DMA_FROM_DEVICE);
+exit_import_put:
+	dma_buf_put(dbuf);
+	return result;
 }
 
-/* put buffer to dequeue
- * called on VIDIOC_DQBUF
+/* export an inner buffer as dma-buf file descriptor
+ * called on VIDIOC_EXPBUF
  */
-static int vidioc_dqbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
+static int vidioc_expbuf(struct file *file, void *fh,
+			 struct v4l2_exportbuffer *eb)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
-	u32 type = buf->type;
-	int index;
-	struct v4l2l_buffer *bufd;
+	struct v4l2l_planes layout;
+	struct dma_buf *dbuf;
+	u8 *addr;
+	int result;
 
-	if (buf->memory != V4L2_MEMORY_MMAP)
+	if (!is_video_type(eb->type))
 		return -EINVAL;
-	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
-		*buf = dev->timeout_buffer.buffer;
-		buf->type = type;
-		unset_flags(buf->flags);
-		return 0;
-	}
-	if ((opener->buffer_count == 0) ||
-	    !(opener->format_token & token_from_type(type)))
+	if (eb->flags & ~(O_CLOEXEC | O_ACCMODE))
+		return -EINVAL;
+	if (opener->format_token & V4L2L_TOKEN_TIMEOUT)
+		/* the timeout image is only ever mapped by its writer */
+		return -EINVAL;
+	if (!is_allocated(opener, eb->type, eb->index))
 		return -EINVAL;
 
-	switch (type) {
-	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
-		index = get_capture_buffer(file);
-		if (index < 0)
-			return index;
-		*buf = dev->buffers[index].buffer;
-		unset_flags(buf->flags);
-		break;
-	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
-		spin_lock_bh(&dev->list_lock);
-
-		bufd = list_first_entry_or_null(&dev->outbufs_list,
-						struct v4l2l_buffer, list_head);
-		if (bufd)
-			list_move_tail(&bufd->list_head, &dev->outbufs_list);
+	result = mutex_lock_killable(&dev->image_mutex);
+	if (result < 0)
+		return result;
+	get_planes(dev, eb->type, &layout);
+	addr = allocate_buffer_data(dev, &dev->buffers[eb->index]);
+	if (!addr)
+		dbuf = ERR_PTR(dev->buffer_size ? -ENOMEM : -EINVAL);
+	else if (eb->plane < layout.count)
+		dbuf = v4l2l_dmabuf_export(addr + layout.offset[eb->plane],
+					   layout.size[eb->plane],
+					   eb->flags & O_ACCMODE);
+	else
+		dbuf = ERR_PTR(-EINVAL);
+	mutex_unlock(&dev->image_mutex);
+	if (IS_ERR(dbuf))
+		return PTR_ERR(dbuf);
 
-		spin_unlock_bh(&dev->list_lock);
-		if (!bufd)
-			return -EFAULT;
-		unset_flags(bufd->buffer.flags);
-		*buf = bufd->buffer;
-		break;
-	default:
-		return -EINVAL;
+	result = dma_buf_fd(dbuf, eb->flags & ~O_ACCMODE);
+	if (result < 0) {
+		dma_buf_put(dbuf);
+		return result;
 	}
-
-	buf->type = type;
-	dprintkrw("DQBUF(%s, index=%u) -> " BUFFER_DEBUG_FMT_STR,
-		  V4L2_TYPE_IS_CAPTURE(type) ? "CAPTURE" : "OUTPUT", index,
-		  BUFFER_DEBUG_FMT_ARGS(buf));
+	eb->fd = result;
+	dprintkrw("EXPBUF(%s, index=%u) -> fd=%d\n",
+		  V4L2_TYPE_IS_CAPTURE(eb->type) ? "CAPTURE" : "OUTPUT",
+		  eb->index, eb->fd);
 	return 0;
 }
+#endif /* HAVE_DMABUF */
 
 /* ------------- STREAMING ------------------- */
 
+/* let a new consumer of a compressed stream start at the newest keyframe
+ * that is still in the ring, so it can decode right away */
+static void join_at_keyframe(struct v4l2_loopback_device *dev,
+			     struct v4l2_loopback_opener *opener)
+{
+	const struct v4l2l_format *fmt =
+		format_by_fourcc(dev->pix_format.pixelformat);
+	unsigned int seq;
+	s64 keyframe;
+
+	if (!fmt || !(fmt->flags & FORMAT_FLAGS_COMPRESSED))
+		return;
+	do {
+		seq = read_seqcount_begin(&dev->head_seq);
+		keyframe = dev->keyframe_position;
+	} while (read_seqcount_retry(&dev->head_seq, seq));
+	opener->wait_keyframe = false;
+	if (keyframe < 0)
+		/* (the producer may not mark keyframes at all) */
+		return;
+	if (!seek_capture(dev, opener, keyframe, false)) {
+		dprintk("STREAMON(CAPTURE) starting at keyframe %lld\n",
+			(long long)keyframe);
+	} else {
+		/* it is not in the ring anymore, so wait for the next one */
+		dprintk("STREAMON(CAPTURE) waiting for a keyframe\n");
+		opener->wait_keyframe = true;
+	}
+}
+
 /* start streaming
  * called on VIDIOC_STREAMON
  */
@@ -2028,16 +4183,30 @@ static int vidioc_streamon(struct file *file, void *fh, enum v4l2_buf_type type)
 
 	switch (type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+#endif
 		if (has_output_token(dev->stream_tokens) && !dev->keep_format)
 			return -EIO;
 		if (dev->stream_tokens & token) {
 			acquire_token(dev, opener, stream, token);
 			client_usage_queue_event(dev->vdev);
+			/* the first frame is all new */
+			opener->damage_position = -1;
+			join_at_keyframe(dev, opener);
 		}
 		return 0;
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
-		if (dev->stream_tokens & token)
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+#endif
+		if (dev->stream_tokens & token) {
 			acquire_token(dev, opener, stream, token);
+			/* readers no longer arm the timers themselves */
+			spin_lock_bh(&dev->lock);
+			check_timers(dev);
+			spin_unlock_bh(&dev->lock);
+		}
 		return 0;
 	default:
 		return -EINVAL;
@@ -2068,6 +4237,9 @@ static int vidioc_streamoff(struct file *file, void *fh,
 
 	switch (type) {
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+#endif
 		if (opener->stream_token & token)
 			release_token(dev, opener, stream);
 		/* reset output queue */
@@ -2075,10 +4247,19 @@ static int vidioc_streamoff(struct file *file, void *fh,
 			prepare_buffer_queue(dev, dev->used_buffer_count);
 		return 0;
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+#ifdef HAVE_MPLANE
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+#endif
 		if (opener->stream_token & token) {
 			release_token(dev, opener, stream);
 			client_usage_queue_event(dev->vdev);
+			/* the producer need not wait for this consumer */
+			wake_up_all(&dev->write_event);
 		}
+		/* drop all queued USERPTR buffers */
+		bitmap_zero(opener->user_queued, MAX_BUFFERS);
+		/* and all pins */
+		unpin_buffers(dev, opener);
 		return 0;
 	default:
 		return -EINVAL;
@@ -2160,12 +4341,25 @@ static int vidioc_subscribe_event(struct v4l2_fh *fh,
 }
 
 /* file operations */
+/* a mapping either covers (a part of) a single buffer, whose use is tracked
+ * through `vm_private_data`, or the entire ring (`vm_private_data` is NULL),
+ * which keeps all buffers mapped */
 static void vm_open(struct vm_area_struct *vma)
 {
 	struct v4l2l_buffer *buf;
 	MARK();
 
 	buf = vma->vm_private_data;
+	if (!buf) {
+		struct v4l2_loopback_device *dev =
+			v4l2loopback_getdevice(vma->vm_file);
+		u32 i;
+
+		dev->ring_use_count++;
+		for (i = 0; i < dev->buffer_count; ++i)
+			dev->buffers[i].buffer.flags |= V4L2_BUF_FLAG_MAPPED;
+		return;
+	}
 	buf->use_count++;
 
 	buf->buffer.flags |= V4L2_BUF_FLAG_MAPPED;
@@ -2173,33 +4367,167 @@ static void vm_open(struct vm_area_struct *vma)
 
 static void vm_close(struct vm_area_struct *vma)
 {
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(vma->vm_file);
 	struct v4l2l_buffer *buf;
 	MARK();
 
 	buf = vma->vm_private_data;
+	if (!buf) {
+		u32 i;
+
+		if (--dev->ring_use_count > 0)
+			return;
+		for (i = 0; i < dev->buffer_count; ++i)
+			if (dev->buffers[i].use_count <= 0)
+				dev->buffers[i].buffer.flags &=
+					~V4L2_BUF_FLAG_MAPPED;
+		return;
+	}
 	buf->use_count--;
 
-	if (buf->use_count <= 0)
+	if (buf->use_count <= 0 &&
+	    (buf == &dev->timeout_buffer || dev->ring_use_count <= 0))
 		buf->buffer.flags &= ~V4L2_BUF_FLAG_MAPPED;
 }
 
+/* the buffer at page `pgoff` of the device, and the offset into its data
+ * buffer #i lives at `i * buffer_size` (the timeout buffer at
+ * `MAX_BUFFERS * buffer_size`), so no lookup is needed */
+static struct v4l2l_buffer *vm_buffer(struct vm_area_struct *vma,
+				      pgoff_t pgoff, unsigned long *offset)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(vma->vm_file);
+	unsigned long pos = pgoff << PAGE_SHIFT;
+	u32 index = pos / dev->buffer_size;
+
+	*offset = pos % dev->buffer_size;
+	if (index >= MAX_BUFFERS)
+		return &dev->timeout_buffer;
+	return &dev->buffers[index];
+}
+
+/* buffers are not populated at mmap() time; instead their pages are inserted
+ * as they are touched, which keeps mmap() cheap for large frames */
+static vm_fault_t vm_fault_page(struct vm_fault *vmf)
+{
+	unsigned long offset;
+	struct v4l2l_buffer *buf = vm_buffer(vmf->vma, vmf->pgoff, &offset);
+	u8 *vaddr = smp_load_acquire(&buf->vaddr);
+
+	/* mmap() made sure the mapping only covers allocated buffers, and
+	 * free_buffers() does not free them while mapped; but be safe */
+	if (!vaddr)
+		return VM_FAULT_SIGBUS;
+	vmf->page = vmalloc_to_page(vaddr + offset);
+	get_page(vmf->page);
+	return 0;
+}
+
 static struct vm_operations_struct vm_ops = {
 	.open = vm_open,
 	.close = vm_close,
+	.fault = vm_fault_page,
+};
+
+#ifdef HAVE_HUGEPAGES
+/* buffers backed by huge pages are faulted in as PMDs where the mapping is
+ * suitably aligned, and as regular pages (of any buffer) elsewhere */
+
+static vm_fault_t huge_vm_fault(struct vm_fault *vmf)
+{
+	unsigned long offset;
+	struct v4l2l_buffer *buf = vm_buffer(vmf->vma, vmf->pgoff, &offset);
+	u8 *vaddr = smp_load_acquire(&buf->vaddr);
+
+	if (!vaddr)
+		return VM_FAULT_SIGBUS;
+	return vmf_insert_pfn(vmf->vma, vmf->address,
+			      vmalloc_to_pfn(vaddr + offset));
+}
+
+static vm_fault_t huge_vm_fault_pmd(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long address = vmf->address & HPAGE_PMD_MASK;
+	struct v4l2l_buffer *buf;
+	unsigned long offset;
+
+	/* the PMD must cover exactly one of our huge pages */
+	if (address < vma->vm_start || address + HPAGE_PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	buf = vm_buffer(vma,
+			vmf->pgoff - ((vmf->address - address) >> PAGE_SHIFT),
+			&offset);
+	if (!buf->huge_pages || !IS_ALIGNED(offset, HPAGE_PMD_SIZE))
+		return VM_FAULT_FALLBACK;
+
+	return vmf_insert_pfn_pmd(
+		vmf,
+		v4l2l_pfn_t(page_to_pfn(buf->huge_pages[offset / HPAGE_PMD_SIZE])),
+		vmf->flags & FAULT_FLAG_WRITE);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t huge_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	if (order != HPAGE_PMD_ORDER)
+		return VM_FAULT_FALLBACK;
+	return huge_vm_fault_pmd(vmf);
+}
+#else
+static vm_fault_t huge_vm_huge_fault(struct vm_fault *vmf,
+				     enum page_entry_size pe_size)
+{
+	if (pe_size != PE_SIZE_PMD)
+		return VM_FAULT_FALLBACK;
+	return huge_vm_fault_pmd(vmf);
+}
+#endif
+
+static struct vm_operations_struct huge_vm_ops = {
+	.open = vm_open,
+	.close = vm_close,
+	.fault = huge_vm_fault,
+	.huge_fault = huge_vm_huge_fault,
 };
+#endif /* HAVE_HUGEPAGES */
+
+/* the status page is read-only and independent of the buffers, so it can be
+ * mapped at any time */
+static int map_status_page(struct v4l2_loopback_device *dev,
+			   struct vm_area_struct *vma)
+{
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE) {
+		dprintk("mmap() status page must be mapped as a single page\n");
+		return -EINVAL;
+	}
+	if (vma->vm_flags & VM_WRITE) {
+		dprintk("mmap() status page is read-only\n");
+		return -EPERM;
+	}
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(dev->status));
+}
 
 static int v4l2_loopback_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	u8 *addr;
-	unsigned long start, size;
+	unsigned long size, offset;
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
 	struct v4l2l_buffer *buffer = NULL;
+	struct vm_operations_struct *ops = &vm_ops;
+#ifdef HAVE_HUGEPAGES
+	bool pfnmap = false;
+#endif
 	int result = 0;
 	MARK();
 
-	start = (unsigned long)vma->vm_start;
 	size = (unsigned long)(vma->vm_end - vma->vm_start);
+	offset = vma->vm_pgoff << PAGE_SHIFT;
+
+	if (((u64)vma->vm_pgoff << PAGE_SHIFT) == V4L2LOOPBACK_STATUS_OFFSET)
+		return map_status_page(dev, vma);
 
 	/* ensure buffer size, number, and allocated image are not altered by
 	 * other file descriptors */
@@ -2207,68 +4535,83 @@ static int v4l2_loopback_mmap(struct file *file, struct vm_area_struct *vma)
 	if (result < 0)
 		return result;
 
-	if (size > dev->buffer_size) {
-		dprintk("mmap() attempt to map more than allocated to "
-			"buffer\n");
+	if (!dev->buffer_size) {
+		dprintk("mmap() attempt to map when buffers are unallocated\n");
 		result = -EINVAL;
 		goto exit_mmap_unlock;
 	}
 	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
 		/* we are going to map the timeout_buffer */
-		if ((vma->vm_pgoff << PAGE_SHIFT) !=
-		    (unsigned long)dev->buffer_size * MAX_BUFFERS) {
+		if (offset != (unsigned long)dev->buffer_size * MAX_BUFFERS ||
+		    size > dev->buffer_size) {
 			dprintk("mmap() invalid offset for timeout image\n");
 			result = -EINVAL;
+			goto exit_mmap_unlock;
 		}
-	} else if (!dev->buffer_count ||
-		   (vma->vm_pgoff << PAGE_SHIFT) >
-			   (unsigned long)dev->buffer_size *
-				   (dev->buffer_count - 1u)) {
-		dprintk("mmap() attempt to map outside of buffers\n");
-		result = -EINVAL;
-	}
-	if (!result && !dev->image) {
-		dprintk("mmap() attempt to map when buffers are unallocated\n");
-		result = -EINVAL;
-	}
-
-	if (result < 0)
-		goto exit_mmap_unlock;
-
-	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
 		buffer = &dev->timeout_buffer;
-		addr = dev->timeout_image;
-	} else {
-		u32 i;
-		for (i = 0; i < dev->buffer_count; ++i) {
-			buffer = &dev->buffers[i];
-			if ((buffer->buffer.m.offset >> PAGE_SHIFT) ==
-			    vma->vm_pgoff)
-				break;
+		if (!buffer->vaddr) {
+			dprintk("mmap() timeout image is unallocated\n");
+			result = -EINVAL;
+			goto exit_mmap_unlock;
 		}
-
-		if (i >= dev->buffer_count) {
+	} else if (offset == V4L2LOOPBACK_RING_OFFSET &&
+		   size > dev->buffer_size) {
+		/* map (the first buffers of) the ring at once; buffers are at
+		 * the offsets reported by QUERYBUF */
+		u32 i, count = DIV_ROUND_UP(size, dev->buffer_size);
+
+		if (count > dev->buffer_count) {
+			dprintk("mmap() attempt to map more than the ring\n");
 			result = -EINVAL;
 			goto exit_mmap_unlock;
 		}
+		for (i = 0; i < count; ++i) {
+			if (!allocate_buffer_data(dev, &dev->buffers[i])) {
+				result = -ENOMEM;
+				goto exit_mmap_unlock;
+			}
+#ifdef HAVE_HUGEPAGES
+			pfnmap |= !!dev->buffers[i].huge_pages;
+#endif
+		}
+	} else {
+		/* the planes of multi-planar buffers are mapped separately */
+		u32 index = offset / dev->buffer_size;
 
-		addr = dev->image + (vma->vm_pgoff << PAGE_SHIFT);
+		if (index >= dev->buffer_count ||
+		    size > dev->buffer_size - offset % dev->buffer_size) {
+			dprintk("mmap() attempt to map outside of buffers\n");
+			result = -EINVAL;
+			goto exit_mmap_unlock;
+		}
+		buffer = &dev->buffers[index];
+		if (!allocate_buffer_data(dev, buffer)) {
+			result = -ENOMEM;
+			goto exit_mmap_unlock;
+		}
+#ifdef HAVE_HUGEPAGES
+		pfnmap = !!buffer->huge_pages;
+#endif
 	}
 
-	while (size > 0) {
-		struct page *page = vmalloc_to_page(addr);
-
-		if (vm_insert_page(vma, start, page) < 0) {
-			result = -EAGAIN;
+#ifdef HAVE_HUGEPAGES
+	if (pfnmap) {
+		/* huge_vm_ops insert the pages on demand; to get PMDs, the
+		 * mapping must be 2MiB-aligned (which is up to the caller, as
+		 * v4l2 does not let us pick the address) */
+		if (!(vma->vm_flags & VM_SHARED)) {
+			dprintk("mmap() huge page buffers must be mapped "
+				"MAP_SHARED\n");
+			result = -EINVAL;
 			goto exit_mmap_unlock;
 		}
-
-		start += PAGE_SIZE;
-		addr += PAGE_SIZE;
-		size -= PAGE_SIZE;
+		vm_flags_set(vma, VM_PFNMAP | VM_HUGEPAGE);
+		ops = &huge_vm_ops;
 	}
+#endif
 
-	vma->vm_ops = &vm_ops;
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_ops = ops;
 	vma->vm_private_data = buffer;
 
 	vm_open(vma);
@@ -2287,7 +4630,9 @@ static unsigned int v4l2_loopback_poll(struct file *file,
 
 	/* call poll_wait in first call, regardless, to ensure that the
 	 * wait-queue is not null */
-	poll_wait(file, &dev->read_event, pts);
+	poll_wait(file, &opener->read_event, pts);
+	/* (woken when buffers are unpinned, or frames read in lossless mode) */
+	poll_wait(file, &dev->write_event, pts);
 	poll_wait(file, &opener->fh.wait, pts);
 
 	if (req_events & POLLPRI) {
@@ -2300,8 +4645,9 @@ static unsigned int v4l2_loopback_poll(struct file *file,
 
 	switch (opener->format_token) {
 	case V4L2L_TOKEN_OUTPUT:
-		if (opener->stream_token != 0 ||
-		    opener->io_method == V4L2L_IO_NONE)
+		if ((opener->stream_token != 0 ||
+		     opener->io_method == V4L2L_IO_NONE) &&
+		    output_buffer_ready(dev))
 			ret_mask |= POLLOUT | POLLWRNORM;
 		break;
 	case V4L2L_TOKEN_CAPTURE:
@@ -2326,6 +4672,7 @@ static int v4l2_loopback_open(struct file *file)
 {
 	struct v4l2_loopback_device *dev;
 	struct v4l2_loopback_opener *opener;
+	int err;
 
 	dev = v4l2loopback_getdevice(file);
 	if (dev->open_count.counter >= dev->max_openers)
@@ -2334,18 +4681,35 @@ static int v4l2_loopback_open(struct file *file)
 	opener = kzalloc(sizeof(*opener), GFP_KERNEL);
 	if (opener == NULL)
 		return -ENOMEM;
+	err = init_opener_ctrls(dev, opener);
+	if (err < 0) {
+		kfree(opener);
+		return err;
+	}
 
 	atomic_inc(&dev->open_count);
+	/* only timeouts passing from now on concern this opener */
+	opener->timeout_count = READ_ONCE(dev->timeout_count);
+	opener->damage_count = -1;
+	opener->damage_position = -1;
+	opener->meta_buffer = -1;
+	spin_lock_init(&opener->read_lock);
 	if (dev->timeout_image_io && dev->format_tokens & V4L2L_TOKEN_TIMEOUT)
 		/* will clear timeout_image_io once buffer set acquired */
 		opener->io_method = V4L2L_IO_TIMEOUT;
 
+	init_waitqueue_head(&opener->read_event);
+	spin_lock_bh(&dev->lock);
+	list_add_tail(&opener->node, &dev->openers);
+	spin_unlock_bh(&dev->lock);
+
 	v4l2_fh_init(&opener->fh, video_devdata(file));
+	opener->fh.ctrl_handler = &opener->ctrl_handler;
 	file->private_data = &opener->fh;
 
 	v4l2_fh_add(&opener->fh);
-	dprintk("open() -> dev@%p with image@%p\n", dev,
-		dev ? dev->image : NULL);
+	dprintk("open() -> dev@%p with %u buffers of %ubytes\n", dev,
+		dev ? dev->buffer_count : 0, dev ? dev->buffer_size : 0);
 	return 0;
 }
 
@@ -2354,8 +4718,8 @@ static int v4l2_loopback_close(struct file *file)
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
 	int result = 0;
-	dprintk("close() -> dev@%p with image@%p\n", dev,
-		dev ? dev->image : NULL);
+	dprintk("close() -> dev@%p with %u buffers of %ubytes\n", dev,
+		dev ? dev->buffer_count : 0, dev ? dev->buffer_size : 0);
 
 	if (opener->format_token) {
 		struct v4l2_requestbuffers reqbuf = {
@@ -2381,10 +4745,12 @@ static int v4l2_loopback_close(struct file *file)
 		release_token(dev, opener, format);
 		mutex_unlock(&dev->image_mutex);
 	}
+	unpin_buffers(dev, opener);
+	free_buffer_meta(dev, opener);
 
 	if (atomic_dec_and_test(&dev->open_count)) {
-		del_timer_sync(&dev->sustain_timer);
-		del_timer_sync(&dev->timeout_timer);
+		v4l2l_timer_cancel(&dev->sustain_timer);
+		v4l2l_timer_cancel(&dev->timeout_timer);
 		if (!dev->keep_format) {
 			mutex_lock(&dev->image_mutex);
 			free_buffers(dev);
@@ -2392,8 +4758,14 @@ static int v4l2_loopback_close(struct file *file)
 		}
 	}
 
+	spin_lock_bh(&dev->lock);
+	list_del(&opener->node);
+	spin_unlock_bh(&dev->lock);
+	wake_up_all(&dev->write_event);
+
 	v4l2_fh_del(&opener->fh);
 	v4l2_fh_exit(&opener->fh);
+	v4l2_ctrl_handler_free(&opener->ctrl_handler);
 
 	kfree(opener);
 	return 0;
@@ -2436,7 +4808,9 @@ static ssize_t v4l2_loopback_read(struct file *file, char __user *buf,
 				  size_t count, loff_t *ppos)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
-	struct v4l2_buffer *b;
+	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
+	struct v4l2l_buffer *bufd;
+	u8 *addr;
 	int index, result;
 
 	dprintkrw("read() %zu bytes\n", count);
@@ -2448,11 +4822,14 @@ static ssize_t v4l2_loopback_read(struct file *file, char __user *buf,
 	index = get_capture_buffer(file);
 	if (index < 0)
 		return index;
-	b = &dev->buffers[index].buffer;
-	if (count > b->bytesused)
-		count = b->bytesused;
-	if (copy_to_user((void *)buf, (void *)(dev->image + b->m.offset),
-			 count)) {
+	keep_frame_meta(dev, opener, index);
+	bufd = &dev->buffers[index];
+	addr = get_buffer_data(dev, bufd);
+	if (!addr)
+		return -ENOMEM;
+	if (count > bufd->buffer.bytesused)
+		count = bufd->buffer.bytesused;
+	if (copy_to_user((void *)buf, (void *)addr, count)) {
 		printk(KERN_ERR "v4l2-loopback read() failed copy_to_user()\n");
 		return -EFAULT;
 	}
@@ -2463,8 +4840,11 @@ static ssize_t v4l2_loopback_write(struct file *file, const char __user *buf,
 				   size_t count, loff_t *ppos)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
+	struct v4l2l_buffer *bufd;
 	struct v4l2_buffer *b;
-	int index, result;
+	u8 *addr;
+	int result;
 
 	dprintkrw("write() %zu bytes\n", count);
 	result = start_fileio(file, file->private_data,
@@ -2472,45 +4852,186 @@ static ssize_t v4l2_loopback_write(struct file *file, const char __user *buf,
 	if (result < 0)
 		return result;
 
+	result = wait_output_buffer(file, &bufd);
+	if (result < 0)
+		return result;
+
 	if (count > dev->buffer_size)
 		count = dev->buffer_size;
-	index = v4l2l_mod64(dev->write_position, dev->used_buffer_count);
-	b = &dev->buffers[index].buffer;
+	b = &bufd->buffer;
+	addr = get_buffer_data(dev, bufd);
+	if (!addr) {
+		result = -ENOMEM;
+		goto write_failed;
+	}
 
-	if (copy_from_user((void *)(dev->image + b->m.offset), (void *)buf,
-			   count)) {
+	if (copy_from_user((void *)addr, (void *)buf, count)) {
 		printk(KERN_ERR
 		       "v4l2-loopback write() failed copy_from_user()\n");
-		return -EFAULT;
+		result = -EFAULT;
+		goto write_failed;
 	}
 	b->bytesused = count;
+	b->flags &= ~V4L2L_FRAME_FLAGS;
+	memcpy(bufd->meta, opener->meta, sizeof(bufd->meta));
+	attach_damage(dev, opener, bufd);
 
 	v4l2l_get_timestamp(b);
 	b->sequence = dev->write_position;
 	set_queued(b->flags);
-	buffer_written(dev, &dev->buffers[index]);
+	buffer_written(dev, bufd);
 	set_done(b->flags);
-	wake_up_all(&dev->read_event);
+	wake_up_readers(dev);
 
 	return count;
+
+write_failed:
+	spin_lock_bh(&dev->lock);
+	bufd->filling = false;
+	spin_unlock_bh(&dev->lock);
+	return result;
 }
 
 /* init functions */
+/* releases the data of a single buffer */
+static void free_buffer_data(struct v4l2l_buffer *bufd)
+{
+#ifdef HAVE_HUGEPAGES
+	if (bufd->huge_pages) {
+		u32 i;
+
+		if (bufd->vaddr)
+			vunmap(bufd->vaddr);
+		for (i = 0; i < bufd->huge_count; ++i)
+			if (bufd->huge_pages[i])
+				__free_pages(bufd->huge_pages[i],
+					     HPAGE_PMD_ORDER);
+		kfree(bufd->huge_pages);
+		bufd->huge_pages = NULL;
+		bufd->huge_count = 0;
+		bufd->vaddr = NULL;
+		return;
+	}
+#endif
+	vfree(bufd->vaddr);
+	bufd->vaddr = NULL;
+}
+
+#ifdef HAVE_HUGEPAGES
+/* backs a buffer of `size` bytes (a multiple of HPAGE_PMD_SIZE) with huge
+ * pages, which are vmap'd so the kernel sees a contiguous buffer as well */
+static int allocate_huge_buffer_data(struct v4l2l_buffer *bufd, u32 size)
+{
+	u32 huge_count = size / HPAGE_PMD_SIZE;
+	u32 page_count = size >> PAGE_SHIFT;
+	struct page **pages;
+	u8 *vaddr;
+	u32 i, j;
+
+	bufd->huge_pages =
+		kcalloc(huge_count, sizeof(*bufd->huge_pages), GFP_KERNEL);
+	pages = kvmalloc_array(page_count, sizeof(*pages), GFP_KERNEL);
+	if (!bufd->huge_pages || !pages)
+		goto error;
+	bufd->huge_count = huge_count;
+
+	for (i = 0; i < bufd->huge_count; ++i) {
+		/* (zeroed, as they are mapped into userspace) */
+		struct page *page = alloc_pages(GFP_KERNEL | __GFP_COMP |
+							__GFP_ZERO |
+							__GFP_NOWARN |
+							__GFP_NORETRY,
+						HPAGE_PMD_ORDER);
+		if (!page)
+			goto error;
+		bufd->huge_pages[i] = page;
+		for (j = 0; j < HPAGE_PMD_NR; ++j)
+			pages[i * HPAGE_PMD_NR + j] = nth_page(page, j);
+	}
+	vaddr = vmap(pages, page_count, VM_MAP, PAGE_KERNEL);
+	if (!vaddr)
+		goto error;
+	kvfree(pages);
+	smp_store_release(&bufd->vaddr, vaddr);
+	return 0;
+error:
+	kvfree(pages);
+	free_buffer_data(bufd);
+	return -ENOMEM;
+}
+#endif
+
+/* allocates the data of a ring buffer, unless it already has some
+ * must be called with `image_mutex` held */
+static u8 *allocate_buffer_data(struct v4l2_loopback_device *dev,
+				struct v4l2l_buffer *bufd)
+{
+	u8 *vaddr;
+
+	if (bufd->vaddr || !dev->buffer_size)
+		return bufd->vaddr;
+#ifdef HAVE_HUGEPAGES
+	if (dev->hugepages) {
+		if (!allocate_huge_buffer_data(bufd, dev->buffer_size))
+			return bufd->vaddr;
+		dprintk("allocate_buffer_data() no huge pages for buffer#%u, "
+			"falling back to vmalloc\n",
+			bufd->buffer.index);
+	}
+#endif
+	/* (zeroed, as it is mapped into userspace) */
+	vaddr = vzalloc(dev->buffer_size);
+	if (!vaddr)
+		return NULL;
+	dprintk("allocate_buffer_data() vmalloc'd %ubytes for buffer#%u\n",
+		dev->buffer_size, bufd->buffer.index);
+	smp_store_release(&bufd->vaddr, vaddr);
+	return vaddr;
+}
+
+/* returns the data of a ring buffer, which is allocated on first use: rings
+ * are sized for the largest number of buffers, but most of them are often
+ * never touched
+ * once allocated, this is a plain (acquire) load; only the first use takes
+ * `image_mutex`, which is why the read(), write() and DQBUF paths calling it
+ * must hold neither `image_mutex` nor `lock` */
+static u8 *get_buffer_data(struct v4l2_loopback_device *dev,
+			   struct v4l2l_buffer *bufd)
+{
+	u8 *vaddr = smp_load_acquire(&bufd->vaddr);
+
+	if (likely(vaddr))
+		return vaddr;
+	/* must not be called with `image_mutex` held */
+	mutex_lock(&dev->image_mutex);
+	vaddr = allocate_buffer_data(dev, bufd);
+	mutex_unlock(&dev->image_mutex);
+	return vaddr;
+}
+
 /* frees buffers, if allocated */
 static void free_buffers(struct v4l2_loopback_device *dev)
 {
-	dprintk("free_buffers() with image@%p\n", dev->image);
-	if (!dev->image)
+	u32 i;
+
+	dprintk("free_buffers() with %ubytes per buffer\n", dev->buffer_size);
+	if (dev->buffer_size && any_buffers_mapped(dev)) {
+		/* the pages are inserted on fault, so they must outlive any
+		 * mapping; callers check this, so it should never happen */
+		printk(KERN_WARNING
+		       "v4l2-loopback free_buffers() buffers of video device "
+		       "#%u still mapped to userspace, not freeing them\n",
+		       dev->vdev->num);
 		return;
-	if (!has_no_owners(dev) || any_buffers_mapped(dev))
+	}
+	if (dev->buffer_size && !has_no_owners(dev))
 		/* maybe an opener snuck in before image_mutex was acquired */
 		printk(KERN_WARNING
 		       "v4l2-loopback free_buffers() buffers of video device "
-		       "#%u freed while still mapped to userspace\n",
+		       "#%u freed while still in use\n",
 		       dev->vdev->num);
-	vfree(dev->image);
-	dev->image = NULL;
-	dev->image_size = 0;
+	for (i = 0; i < MAX_BUFFERS; ++i)
+		free_buffer_data(&dev->buffers[i]);
 	dev->buffer_size = 0;
 }
 
@@ -2521,7 +5042,7 @@ static void free_timeout_buffer(struct v4l2_loopback_device *dev)
 	if (!dev->timeout_image)
 		return;
 
-	if ((dev->timeout_jiffies > 0 && !has_no_owners(dev)) ||
+	if ((dev->timeout_ns > 0 && !has_no_owners(dev)) ||
 	    dev->timeout_buffer.buffer.flags & V4L2_BUF_FLAG_MAPPED)
 		printk(KERN_WARNING
 		       "v4l2-loopback free_timeout_buffer() timeout image "
@@ -2530,50 +5051,49 @@ static void free_timeout_buffer(struct v4l2_loopback_device *dev)
 
 	vfree(dev->timeout_image);
 	dev->timeout_image = NULL;
+	dev->timeout_buffer.vaddr = NULL;
 	dev->timeout_buffer_size = 0;
 }
-/* allocates buffers if no (other) openers are already using them */
+/* sets up buffers if no (other) openers are already using them
+ * each buffer is allocated on its own, so large rings do not need a single
+ * (virtually) contiguous area, and only once it is used (see
+ * get_buffer_data()) */
 static int allocate_buffers(struct v4l2_loopback_device *dev,
 			    struct v4l2_pix_format *pix_format)
 {
 	u32 buffer_size = PAGE_ALIGN(pix_format->sizeimage);
-	unsigned long image_size =
-		(unsigned long)buffer_size * (unsigned long)dev->buffer_count;
 	/* vfree on close file operation in case no open handles left */
 
+#ifdef HAVE_HUGEPAGES
+	if (dev->hugepages)
+		buffer_size = ALIGN(pix_format->sizeimage, HPAGE_PMD_SIZE);
+#endif
+
 	if (buffer_size == 0 || dev->buffer_count == 0 ||
 	    buffer_size < pix_format->sizeimage)
 		return -EINVAL;
 
-	if ((__LONG_MAX__ / buffer_size) < dev->buffer_count)
+	if ((__LONG_MAX__ / buffer_size) < MAX_BUFFERS + 1)
+		/* buffers (and timeout image) must be addressable by offset */
 		return -ENOSPC;
 
-	dprintk("allocate_buffers() size %lubytes = %ubytes x %ubuffers\n",
-		image_size, buffer_size, dev->buffer_count);
-	if (dev->image) {
+	dprintk("allocate_buffers() size %ubytes x %ubuffers\n", buffer_size,
+		dev->buffer_count);
+	if (dev->buffer_size) {
 		/* check that no buffers are expected in user-space */
 		if (!has_no_owners(dev) || any_buffers_mapped(dev))
 			return -EBUSY;
-		dprintk("allocate_buffers() existing size=%lubytes\n",
-			dev->image_size);
-		/* FIXME: prevent double allocation more intelligently! */
-		if (image_size == dev->image_size) {
+		dprintk("allocate_buffers() existing size=%ubytes\n",
+			dev->buffer_size);
+		if (buffer_size == dev->buffer_size) {
 			dprintk("allocate_buffers() keep existing\n");
 			return 0;
 		}
 		free_buffers(dev);
 	}
 
-	/* FIXME: set buffers to 0 */
-	dev->image = vmalloc(image_size);
-	if (dev->image == NULL) {
-		dev->buffer_size = dev->image_size = 0;
-		return -ENOMEM;
-	}
 	init_buffers(dev, pix_format->sizeimage, buffer_size);
 	dev->buffer_size = buffer_size;
-	dev->image_size = image_size;
-	dprintk("allocate_buffers() -> vmalloc'd %lubytes\n", dev->image_size);
 	return 0;
 }
 static int allocate_timeout_buffer(struct v4l2_loopback_device *dev)
@@ -2598,6 +5118,7 @@ static int allocate_timeout_buffer(struct v4l2_loopback_device *dev)
 		dev->timeout_buffer_size = 0;
 		return -ENOMEM;
 	}
+	dev->timeout_buffer.vaddr = dev->timeout_image;
 	dev->timeout_buffer_size = dev->buffer_size;
 	return 0;
 }
@@ -2624,7 +5145,8 @@ static void init_buffers(struct v4l2_loopback_device *dev, u32 bytes_used,
 
 		v4l2l_get_timestamp(b);
 	}
-	dev->timeout_buffer = dev->buffers[0];
+	/* the timeout buffer's data lives in `timeout_image` */
+	dev->timeout_buffer.buffer = dev->buffers[0].buffer;
 	dev->timeout_buffer.buffer.m.offset = MAX_BUFFERS * buffer_size;
 }
 
@@ -2666,58 +5188,115 @@ static void init_capture_param(struct v4l2_captureparm *capture_param)
 
 static void check_timers(struct v4l2_loopback_device *dev)
 {
+	ktime_t now;
+
 	if (has_output_token(dev->stream_tokens))
 		return;
 
-	if (dev->timeout_jiffies > 0 && !timer_pending(&dev->timeout_timer))
-		mod_timer(&dev->timeout_timer, jiffies + dev->timeout_jiffies);
-	if (dev->sustain_framerate && !timer_pending(&dev->sustain_timer))
-		mod_timer(&dev->sustain_timer,
-			  jiffies + dev->frame_jiffies * 3 / 2);
+	now = ktime_get();
+	if (dev->timeout_ns > 0 && !v4l2l_timer_pending(&dev->timeout_timer))
+		v4l2l_timer_start(&dev->timeout_timer,
+				  ktime_add_ns(now, dev->timeout_ns));
+	if (dev->sustain_framerate && !v4l2l_timer_pending(&dev->sustain_timer))
+		v4l2l_timer_start(&dev->sustain_timer,
+				  ktime_add_ns(now, dev->frame_ns * 3 / 2));
 }
-#ifdef HAVE_TIMER_SETUP
-static void sustain_timer_clb(struct timer_list *t)
+static void sustain_timer_expired(struct v4l2_loopback_device *dev)
 {
-	struct v4l2_loopback_device *dev = from_timer(dev, t, sustain_timer);
-#else
-static void sustain_timer_clb(unsigned long nr)
+	u64 since, periods;
+
+	spin_lock(&dev->lock);
+	if (!dev->sustain_framerate)
+		goto unlock;
+	since = ktime_to_ns(ktime_sub(ktime_get(), dev->last_write));
+	if (!dev->reread_count && since < dev->frame_ns * 3 / 2) {
+		/* a frame was written since the timer was armed */
+		v4l2l_timer_start(&dev->sustain_timer,
+				  ktime_add_ns(dev->last_write,
+					       dev->frame_ns * 3 / 2));
+		goto unlock;
+	}
+	write_seqcount_begin(&dev->head_seq);
+	dev->reread_count++;
+	dev->publish_time = ktime_get();
+	write_seqcount_end(&dev->head_seq);
+	dprintkrw("sustain_timer_clb() write_pos=%lld reread=%u\n",
+		  (long long)dev->write_position, dev->reread_count);
+	/* the next duplicate is due on the next frame boundary (counted from
+	 * the last written frame), the first one standing in for the frame
+	 * that was due one period after it; deadlines are absolute, so they
+	 * do not drift */
+	periods = max_t(u64, 2, div64_u64(since, dev->frame_ns) + 1);
+	v4l2l_timer_start(&dev->sustain_timer,
+			  ktime_add_ns(dev->last_write, periods * dev->frame_ns));
+	spin_unlock(&dev->lock);
+	wake_up_readers(dev);
+	return;
+unlock:
+	spin_unlock(&dev->lock);
+}
+static void timeout_timer_expired(struct v4l2_loopback_device *dev)
 {
-	struct v4l2_loopback_device *dev =
-		idr_find(&v4l2loopback_index_idr, nr);
-#endif
+	ktime_t now, deadline;
+
 	spin_lock(&dev->lock);
-	if (dev->sustain_framerate) {
-		dev->reread_count++;
-		dprintkrw("sustain_timer_clb() write_pos=%lld reread=%u\n",
-			  (long long)dev->write_position, dev->reread_count);
-		if (dev->reread_count == 1)
-			mod_timer(&dev->sustain_timer,
-				  jiffies + max(1UL, dev->frame_jiffies / 2));
-		else
-			mod_timer(&dev->sustain_timer,
-				  jiffies + dev->frame_jiffies);
-		wake_up_all(&dev->read_event);
+	if (!dev->timeout_ns)
+		goto unlock;
+	now = ktime_get();
+	deadline = ktime_add_ns(dev->last_write, dev->timeout_ns);
+	if (ktime_before(now, deadline)) {
+		/* a frame was written since the timer was armed */
+		v4l2l_timer_start(&dev->timeout_timer, deadline);
+		goto unlock;
 	}
+	write_seqcount_begin(&dev->head_seq);
+	dev->timeout_count++;
+	write_seqcount_end(&dev->head_seq);
+	v4l2l_timer_start(&dev->timeout_timer,
+			  ktime_add_ns(now, dev->timeout_ns));
+	spin_unlock(&dev->lock);
+	wake_up_readers(dev);
+	return;
+unlock:
 	spin_unlock(&dev->lock);
 }
-#ifdef HAVE_TIMER_SETUP
+#if defined(HAVE_HRTIMER_SOFT)
+static enum hrtimer_restart sustain_timer_clb(struct hrtimer *t)
+{
+	sustain_timer_expired(container_of(t, struct v4l2_loopback_device,
+					   sustain_timer.timer));
+	/* the timer re-arms itself, if needed */
+	return HRTIMER_NORESTART;
+}
+static enum hrtimer_restart timeout_timer_clb(struct hrtimer *t)
+{
+	timeout_timer_expired(container_of(t, struct v4l2_loopback_device,
+					   timeout_timer.timer));
+	return HRTIMER_NORESTART;
+}
+#elif defined(HAVE_TIMER_SETUP)
+static void sustain_timer_clb(struct timer_list *t)
+{
+	struct v4l2_loopback_device *dev =
+		from_timer(dev, t, sustain_timer.timer);
+	sustain_timer_expired(dev);
+}
 static void timeout_timer_clb(struct timer_list *t)
 {
-	struct v4l2_loopback_device *dev = from_timer(dev, t, timeout_timer);
+	struct v4l2_loopback_device *dev =
+		from_timer(dev, t, timeout_timer.timer);
+	timeout_timer_expired(dev);
+}
 #else
+static void sustain_timer_clb(unsigned long nr)
+{
+	sustain_timer_expired(idr_find(&v4l2loopback_index_idr, nr));
+}
 static void timeout_timer_clb(unsigned long nr)
 {
-	struct v4l2_loopback_device *dev =
-		idr_find(&v4l2loopback_index_idr, nr);
-#endif
-	spin_lock(&dev->lock);
-	if (dev->timeout_jiffies > 0) {
-		dev->timeout_happened = 1;
-		mod_timer(&dev->timeout_timer, jiffies + dev->timeout_jiffies);
-		wake_up_all(&dev->read_event);
-	}
-	spin_unlock(&dev->lock);
+	timeout_timer_expired(idr_find(&v4l2loopback_index_idr, nr));
 }
+#endif
 
 /* init loopback main structure */
 #define DEFAULT_FROM_CONF(confmember, default_condition, default_value)        \
@@ -2726,7 +5305,8 @@ static void timeout_timer_clb(unsigned long nr)
 							 (conf->confmember)) : \
 		 default_value)
 
-static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
+static int v4l2_loopback_add(struct v4l2_loopback_config *conf,
+			     bool hugepages, int *ret_nr)
 {
 	struct v4l2_loopback_device *dev;
 	struct v4l2_ctrl_handler *hdl;
@@ -2790,6 +5370,14 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	if (!dev)
 		return -ENOMEM;
 
+	BUILD_BUG_ON(MAX_BUFFERS * sizeof(*dev->status) > PAGE_SIZE);
+	dev->status = (u32 *)__get_free_page(GFP_KERNEL);
+	if (!dev->status) {
+		err = -ENOMEM;
+		goto out_free_dev;
+	}
+	memset(dev->status, 0xff, PAGE_SIZE); /* V4L2LOOPBACK_SEQUENCE_INVALID */
+
 	/* allocate id, if @id >= 0, we're requesting that specific id */
 	if (nr >= 0) {
 		err = idr_alloc(&v4l2loopback_index_idr, dev, nr, nr + 1,
@@ -2844,6 +5432,7 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	/* initialise v4l2-loopback specific parameters */
 	MARK();
 	dev->announce_all_caps = _announce_all_caps;
+	dev->hugepages = hugepages;
 	dev->min_width = _min_width;
 	dev->min_height = _min_height;
 	dev->max_width = _max_width;
@@ -2874,12 +5463,11 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	/* ctrls parameters */
 	dev->keep_format = 0;
 	dev->sustain_framerate = 0;
-	dev->timeout_jiffies = 0;
+	dev->timeout_ns = 0;
 	dev->timeout_image_io = 0;
+	dev->lossless = 0;
 
 	/* initialise OUTPUT and CAPTURE buffer values */
-	dev->image = NULL;
-	dev->image_size = 0;
 	dev->buffer_count = _max_buffers;
 	dev->buffer_size = 0;
 	dev->used_buffer_count = 0;
@@ -2892,38 +5480,47 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	} while (0);
 	memset(dev->bufpos2index, 0, sizeof(dev->bufpos2index));
 	dev->write_position = 0;
+	dev->keyframe_position = -1;
 
 	/* initialise synchronisation data */
 	atomic_set(&dev->open_count, 0);
 	mutex_init(&dev->image_mutex);
 	spin_lock_init(&dev->lock);
-	spin_lock_init(&dev->list_lock);
-	init_waitqueue_head(&dev->read_event);
+	INIT_LIST_HEAD(&dev->openers);
+	init_waitqueue_head(&dev->write_event);
 	dev->format_tokens = V4L2L_TOKEN_MASK;
 	dev->stream_tokens = V4L2L_TOKEN_MASK;
 
 	/* initialise sustain frame rate and timeout parameters, and timers */
 	dev->reread_count = 0;
+	dev->last_write = ktime_get();
 	dev->timeout_image = NULL;
-	dev->timeout_happened = 0;
-#ifdef HAVE_TIMER_SETUP
-	timer_setup(&dev->sustain_timer, sustain_timer_clb, 0);
-	timer_setup(&dev->timeout_timer, timeout_timer_clb, 0);
+	dev->timeout_count = 0;
+	seqcount_init(&dev->head_seq);
+#if defined(HAVE_HRTIMER_SOFT)
+	hrtimer_setup(&dev->sustain_timer.timer, sustain_timer_clb,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	hrtimer_setup(&dev->timeout_timer.timer, timeout_timer_clb,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+#elif defined(HAVE_TIMER_SETUP)
+	timer_setup(&dev->sustain_timer.timer, sustain_timer_clb, 0);
+	timer_setup(&dev->timeout_timer.timer, timeout_timer_clb, 0);
 #else
-	setup_timer(&dev->sustain_timer, sustain_timer_clb, nr);
-	setup_timer(&dev->timeout_timer, timeout_timer_clb, nr);
+	setup_timer(&dev->sustain_timer.timer, sustain_timer_clb, nr);
+	setup_timer(&dev->timeout_timer.timer, timeout_timer_clb, nr);
 #endif
 
 	/* initialise the control handler and add controls */
 	MARK();
 	hdl = &dev->ctrl_handler;
-	err = v4l2_ctrl_handler_init(hdl, 4);
+	err = v4l2_ctrl_handler_init(hdl, 5);
 	if (err)
 		goto out_unregister;
 	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_keepformat, NULL);
 	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_sustainframerate, NULL);
 	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_timeout, NULL);
 	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_timeoutimageio, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_lossless, NULL);
 	if (hdl->error) {
 		err = hdl->error;
 		goto out_free_handler;
@@ -2961,6 +5558,7 @@ out_unregister:
 out_free_idr:
 	idr_remove(&v4l2loopback_index_idr, nr);
 out_free_dev:
+	free_page((unsigned long)dev->status);
 	kfree(dev);
 	return err;
 }
@@ -2978,6 +5576,8 @@ static void v4l2_loopback_remove(struct v4l2_loopback_device *dev)
 	video_unregister_device(dev->vdev);
 	v4l2_device_unregister(&dev->v4l2_dev);
 	idr_remove(&v4l2loopback_index_idr, device_nr);
+	/* (mappings of the status page hold their own reference) */
+	free_page((unsigned long)dev->status);
 	kfree(dev);
 }
 
@@ -3007,7 +5607,8 @@ static long v4l2loopback_control_ioctl(struct file *file, unsigned int cmd,
 				break;
 		} else
 			confptr = NULL;
-		ret = v4l2_loopback_add(confptr, &device_nr);
+		ret = v4l2_loopback_add(confptr, V4L2LOOPBACK_DEFAULT_HUGEPAGES,
+					&device_nr);
 		if (ret >= 0)
 			ret = device_nr;
 		break;
@@ -3142,6 +5743,16 @@ static const struct v4l2_ioctl_ops v4l2_loopback_ioctl_ops = {
 	.vidioc_g_fmt_vid_out		= &vidioc_g_fmt_out,
 	.vidioc_try_fmt_vid_out		= &vidioc_try_fmt_out,
 
+#ifdef HAVE_MPLANE
+	.vidioc_s_fmt_vid_cap_mplane	= &vidioc_s_fmt_cap,
+	.vidioc_g_fmt_vid_cap_mplane	= &vidioc_g_fmt_cap,
+	.vidioc_try_fmt_vid_cap_mplane	= &vidioc_try_fmt_cap,
+
+	.vidioc_s_fmt_vid_out_mplane	= &vidioc_s_fmt_out,
+	.vidioc_g_fmt_vid_out_mplane	= &vidioc_g_fmt_out,
+	.vidioc_try_fmt_vid_out_mplane	= &vidioc_try_fmt_out,
+#endif
+
 #ifdef V4L2L_OVERLAY
 	.vidioc_s_fmt_vid_overlay	= &vidioc_s_fmt_overlay,
 	.vidioc_g_fmt_vid_overlay	= &vidioc_g_fmt_overlay,
@@ -3157,9 +5768,14 @@ static const struct v4l2_ioctl_ops v4l2_loopback_ioctl_ops = {
 	.vidioc_s_parm			= &vidioc_s_parm,
 
 	.vidioc_reqbufs			= &vidioc_reqbufs,
+	.vidioc_create_bufs		= &vidioc_create_bufs,
 	.vidioc_querybuf		= &vidioc_querybuf,
 	.vidioc_qbuf			= &vidioc_qbuf,
+	.vidioc_prepare_buf		= &vidioc_prepare_buf,
 	.vidioc_dqbuf			= &vidioc_dqbuf,
+#ifdef HAVE_DMABUF
+	.vidioc_expbuf			= &vidioc_expbuf,
+#endif
 
 	.vidioc_streamon		= &vidioc_streamon,
 	.vidioc_streamoff		= &vidioc_streamoff,
@@ -3265,7 +5881,7 @@ static int __init v4l2loopback_init_module(void)
 		if (card_label[i])
 			snprintf(cfg.card_label, sizeof(cfg.card_label), "%s",
 				 card_label[i]);
-		err = v4l2_loopback_add(&cfg, 0);
+		err = v4l2_loopback_add(&cfg, hugepages[i], 0);
 		if (err) {
 			free_devices();
 			goto error;
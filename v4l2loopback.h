@@ -95,4 +95,50 @@ struct v4l2_loopback_config {
 /* the device-number (either CAPTURE or OUTPUT) associated with the loopback-device */
 #define V4L2LOOPBACK_CTL_REMOVE 0x4C81
 
+/* /dev/video<nr> interface */
+
+/* mmap() offset of the buffer ring:
+ * mapping more than a single buffer at this offset maps the first buffers of
+ * the ring with a single mmap() call, each at the m.offset reported by
+ * VIDIOC_QUERYBUF (relative to the start of the mapping)
+ */
+#define V4L2LOOPBACK_RING_OFFSET 0
+
+/* mmap() offset of the (read-only, single page) status page:
+ * an array of __u32, indexed by buffer index, holding the `sequence` of the
+ * frame that the buffer currently contains, or V4L2LOOPBACK_SEQUENCE_INVALID
+ * while it is being rewritten.
+ * a consumer that reads a dequeued buffer in place can check afterwards (after
+ * a read barrier) whether the entry still matches the `sequence` returned by
+ * VIDIOC_DQBUF; if it does not, the frame changed underneath it and should be
+ * discarded (or the buffer should be copied before reading it).
+ * a frame whose `sequence` is V4L2LOOPBACK_SEQUENCE_INVALID never matches its
+ * entry, so it always counts as changed.
+ * the offset is beyond any buffer (on 32bit systems, it needs a 64bit off_t)
+ */
+#define V4L2LOOPBACK_STATUS_OFFSET 0x100000000ULL
+#define V4L2LOOPBACK_SEQUENCE_INVALID 0xffffffffU
+
+/* size (in bytes) of the 'frame_metadata' control:
+ * the producer sets it to the (opaque) metadata it wants to attach to the
+ * frames it queues from then on; a consumer gets it for the frame in the
+ * buffer selected with the 'metadata_buffer' control, which is set to the
+ * index of each buffer it dequeues (all zeros if the frame has none).
+ * the metadata stays available until the consumer dequeues a frame into the
+ * same buffer index again
+ */
+#define V4L2LOOPBACK_META_SIZE 256
+
+/* number of rectangles in the 'damage' control:
+ * an array of (left, top, width, height) __u32 quadruples; entries with a
+ * zero width or height are unused.
+ * the producer sets it to the areas that changed in the next frame it queues
+ * (no rectangles at all: nothing changed; not set: all of it); a consumer
+ * gets the areas that changed in the frame it dequeued last, since the one
+ * it dequeued before (merged into their bounding box if there are too many).
+ * where the damage is unknown (e.g. before the first frame), it is reported
+ * as the entire frame
+ */
+#define V4L2LOOPBACK_MAX_DAMAGE 16
+
 #endif /* _V4L2LOOPBACK_H */
@@ -304,6 +304,40 @@ static const struct v4l2l_format formats[] = {
 	},
 #endif /* V4L2_PIX_FMT_NV12 */
 
+	/* here come the formats with non-contiguous planes */
+#ifdef V4L2_PIX_FMT_NV12M
+	{
+		.name = "12 bpp Y/CbCr 4:2:0 (N-C)",
+		.fourcc = V4L2_PIX_FMT_NV12M,
+		.depth = 12,
+		.flags = FORMAT_FLAGS_PLANAR | FORMAT_FLAGS_MPLANE,
+	},
+#endif /* V4L2_PIX_FMT_NV12M */
+#ifdef V4L2_PIX_FMT_NV21M
+	{
+		.name = "12 bpp Y/CrCb 4:2:0 (N-C)",
+		.fourcc = V4L2_PIX_FMT_NV21M,
+		.depth = 12,
+		.flags = FORMAT_FLAGS_PLANAR | FORMAT_FLAGS_MPLANE,
+	},
+#endif /* V4L2_PIX_FMT_NV21M */
+#ifdef V4L2_PIX_FMT_YUV420M
+	{
+		.name = "4:2:0, planar, Y-Cb-Cr (N-C)",
+		.fourcc = V4L2_PIX_FMT_YUV420M,
+		.depth = 12,
+		.flags = FORMAT_FLAGS_PLANAR | FORMAT_FLAGS_MPLANE,
+	},
+#endif /* V4L2_PIX_FMT_YUV420M */
+#ifdef V4L2_PIX_FMT_YVU420M
+	{
+		.name = "4:2:0, planar, Y-Cr-Cb (N-C)",
+		.fourcc = V4L2_PIX_FMT_YVU420M,
+		.depth = 12,
+		.flags = FORMAT_FLAGS_PLANAR | FORMAT_FLAGS_MPLANE,
+	},
+#endif /* V4L2_PIX_FMT_YVU420M */
+
 /* here come the compressed formats */
 
 #ifdef V4L2_PIX_FMT_MJPEG